@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -12,6 +12,14 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+//
+// The cache starts with NBUF buffers and grows, a page of
+// buffers at a time from kalloc(), whenever a block misses
+// and no buffer in its bucket is free, so long as that leaves
+// a reserve of free memory for everything else. When memory
+// runs short, bshrink() gives back pages whose buffers are
+// all unused; a buffer nobody holds is clean, since writes
+// go to disk right away and the log pins the ones it holds.
 
 
 #include "types.h"
@@ -23,69 +31,249 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+// Buffers are hashed by (dev, blockno) into buckets, each
+// with its own lock and its own list, so that looking up
+// different blocks on different CPUs doesn't contend.
+#define NBUCKET 31
+#define BHASH(dev, blockno) ((((uint64)(dev) << 16) ^ (blockno)) % NBUCKET)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
 
-  // Linked list of all buffers, through prev/next.
+  // Linked list of the bucket's buffers, through prev/next.
   // Sorted by how recently the buffer was used.
   // head.next is most recent, head.prev is least.
   struct buf head;
+};
+
+// A page of buffers.
+#define BPP ((PGSIZE - sizeof(void*)) / sizeof(struct buf))
+
+struct bpage {
+  struct buf buf[BPP];
+  struct bpage *next;
+};
+
+struct {
+  // Held while moving a buffer from one bucket to another,
+  // so only one bget() at a time holds two bucket locks;
+  // also protects the list of pages.
+  struct spinlock lock;
+  struct bpage *pages;
+  int nbuf;
+  int reserve;    // free pages to leave when growing
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+// Add a page of buffers to the cache, all unused, in bucket
+// bk. Returns 0 if memory is short, which unless force is
+// set means down to the reserve. Caller must hold bcache.lock
+// and bk->lock.
+static int
+bgrow(struct bucket *bk, int force)
+{
+  struct bpage *pg;
+  struct buf *b;
+
+  if((!force && kfreepages() <= bcache.reserve) || (pg = kalloc()) == 0)
+    return 0;
+  for(b = pg->buf; b < pg->buf+BPP; b++){
+    initsleeplock(&b->lock, "buffer");
+    b->dev = 0;
+    b->blockno = 0;
+    b->valid = 0;
+    b->disk = 0;
+    b->refcnt = 0;
+    b->lastuse = 0;
+    b->bucket = bk - bcache.bucket;
+    b->prev = bk->head.prev;
+    b->next = &bk->head;
+    bk->head.prev->next = b;
+    bk->head.prev = b;
+  }
+  pg->next = bcache.pages;
+  bcache.pages = pg;
+  bcache.nbuf += BPP;
+  return 1;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // Never grow into the last eighth of memory.
+  bcache.reserve = kfreepages() / 8;
+
+  // Start the first NBUF buffers off in bucket 0.
+  bk = &bcache.bucket[0];
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  while(bcache.nbuf < NBUF)
+    if(bgrow(bk, 1) == 0)
+      panic("binit");
+  release(&bk->lock);
+  release(&bcache.lock);
+}
+
+// The least recently used unused buffer in bucket bk, or 0.
+// Caller must hold bk->lock.
+static struct buf*
+bunused(struct bucket *bk)
+{
+  struct buf *b;
+
+  for(b = bk->head.prev; b != &bk->head; b = b->prev)
+    if(b->refcnt == 0)
+      return b;
+  return 0;
+}
+
+// Take b off its bucket's list.
+// Caller must hold that bucket's lock.
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Make b, which is unused and on no list, hold blockno and
+// put it at the front of bucket bk, locked. Caller must hold
+// bk->lock. Nobody holds an unused buffer's sleep-lock, so
+// taking it here doesn't sleep, and nobody who finds b in
+// bk can get at it before the caller has read it in.
+static void
+bassign(struct bucket *bk, struct buf *b, uint dev, uint blockno)
+{
+  b->bucket = bk - bcache.bucket;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  acquiresleep(&b->lock);
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// The buffer for block blockno in bucket bk, with another
+// reference, or 0 if it isn't cached.
+// Caller must hold bk->lock.
+static struct buf*
+blookup(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      return b;
+    }
   }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
+// If ahead is set, return 0 instead if the block is cached
+// already or no buffer is free, so a buffer bget() does return
+// was never read.
 static struct buf*
-bget(uint dev, uint blockno)
+bget(uint dev, uint blockno, int ahead)
 {
-  struct buf *b;
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct bucket *obk, *vbk;
+  struct buf *b, *victim;
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  if((b = blookup(bk, dev, blockno)) != 0){
+    if(ahead){
+      b->refcnt--;
+      b = 0;
     }
+    release(&bk->lock);
+    if(b)
+      acquiresleep(&b->lock);
+    return b;
   }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
+  // Recycle the bucket's least recently used unused buffer.
+  if((b = bunused(bk)) != 0){
+    bunlink(b);
+    bassign(bk, b, dev, blockno);
+    release(&bk->lock);
+    return b;
+  }
+  release(&bk->lock);
+
+  // None to spare in this bucket: grow the cache, or if
+  // memory is short, take the least recently used unused
+  // buffer of any other bucket.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  // Another CPU may have cached the block meanwhile.
+  if((b = blookup(bk, dev, blockno)) != 0){
+    if(ahead){
+      b->refcnt--;
+      b = 0;
+    }
+    release(&bk->lock);
+    release(&bcache.lock);
+    if(b)
       acquiresleep(&b->lock);
-      return b;
+    return b;
+  }
+  if((b = bunused(bk)) != 0 || (bgrow(bk, 0) && (b = bunused(bk)) != 0)){
+    bunlink(b);
+  } else {
+    victim = 0;
+    vbk = 0;
+    for(obk = bcache.bucket; obk < bcache.bucket+NBUCKET; obk++){
+      if(obk == bk)
+        continue;
+      acquire(&obk->lock);
+      if((b = bunused(obk)) != 0 && (victim == 0 || b->lastuse < victim->lastuse)){
+        if(vbk)
+          release(&vbk->lock);
+        victim = b;
+        vbk = obk;
+      } else {
+        release(&obk->lock);
+      }
+    }
+    if(victim){
+      bunlink(victim);
+      release(&vbk->lock);
+    } else if(!ahead && bgrow(bk, 1)){
+      // every buffer is in use: dip into the reserve.
+      victim = bunused(bk);
+      bunlink(victim);
+    } else {
+      if(!ahead)
+        panic("bget: no buffers");
+      release(&bk->lock);
+      release(&bcache.lock);
+      return 0;
     }
+    b = victim;
   }
-  panic("bget: no buffers");
+  bassign(bk, b, dev, blockno);
+  release(&bk->lock);
+  release(&bcache.lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,14 +282,39 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
-    b->valid = 1;
+    // bprefetch() may have started reading it already.
+    virtio_disk_wait(b);
   }
+  if(!b->valid)
+    virtio_disk_rw(b, 0);
   return b;
 }
 
+// Start reading block blockno into the cache, if it isn't
+// there, and return without waiting for it.
+// Returns -1 if the disk is too busy to take the read.
+int
+bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget(dev, blockno, 1)) == 0)
+    return 0;
+  b->lastuse = ticks;
+  // the read gets a reference of its own, which the
+  // disk interrupt drops when the read is done.
+  bpin(b);
+  if(virtio_disk_readahead(b) < 0){
+    bunpin(b);
+    brelse(b);
+    return -1;
+  }
+  brelse(b);
+  return 0;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +324,176 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk, and return without
+// waiting. Must be locked, and stay locked until bwait().
+void
+bawrite(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bawrite");
+  virtio_disk_start(b, 1);
+}
+
+// Start writing the n bufs in b[], all locked, in as few
+// disk requests as can be: sorts b[] by block number, and
+// writes each run of consecutive blocks as one request.
+// Call bwait() on each before releasing it.
+void
+bawritev(struct buf **b, int n)
+{
+  struct buf *t;
+  int i, j;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&b[i]->lock))
+      panic("bawritev");
+  for(i = 1; i < n; i++){
+    t = b[i];
+    for(j = i; j > 0 && b[j-1]->blockno > t->blockno; j--)
+      b[j] = b[j-1];
+    b[j] = t;
+  }
+  for(i = 0; i < n; i += j){
+    for(j = 1; i + j < n; j++)
+      if(b[i+j]->blockno != b[i]->blockno + j)
+        break;
+    virtio_disk_startv(b + i, j, 1);
+  }
+}
+
+// Wait for a bawrite() of b to finish.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  virtio_disk_wait(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Move to the head of its bucket's most-recently-used list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[b->bucket];
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
+    bunlink(b);
+    b->next = bk->head.next;
+    b->prev = &bk->head;
+    bk->head.next->prev = b;
+    bk->head.next = b;
   }
   
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[b->bucket];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[b->bucket];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
+}
+
+// The most recent use of any of pg's buffers, or -1 if one
+// is in use. Reads refcnt without locks, so it's a hint.
+static int
+bpageuse(struct bpage *pg)
+{
+  struct buf *b;
+  int last = 0;
+
+  for(b = pg->buf; b < pg->buf+BPP; b++){
+    if(b->refcnt != 0)
+      return -1;
+    if(b->lastuse > last)
+      last = b->lastuse;
+  }
+  return last;
+}
+
+// Take pg's buffers out of the cache if none is in use.
+// Returns 1 if it did. Caller must hold bcache.lock, which
+// keeps buffers from changing buckets, and lets this hold
+// several bucket locks at once.
+static int
+bpagefree(struct bpage *pg)
+{
+  struct buf *b;
+  int i, ok = 1;
+  int lock[NBUCKET];
+
+  memset(lock, 0, sizeof(lock));
+  for(b = pg->buf; b < pg->buf+BPP; b++)
+    lock[b->bucket] = 1;
+  for(i = 0; i < NBUCKET; i++)
+    if(lock[i])
+      acquire(&bcache.bucket[i].lock);
+  for(b = pg->buf; b < pg->buf+BPP; b++)
+    if(b->refcnt != 0)
+      ok = 0;
+  if(ok)
+    for(b = pg->buf; b < pg->buf+BPP; b++)
+      bunlink(b);
+  for(i = 0; i < NBUCKET; i++)
+    if(lock[i])
+      release(&bcache.bucket[i].lock);
+  return ok;
 }
 
+// Give up to n pages of unused buffers back to kalloc(),
+// least recently used first, keeping at least NBUF buffers.
+// kalloc() calls this when it runs out, so it can be called
+// with any lock but the cache's own held; bgrow()'s kalloc()
+// holds bcache.lock, and gets nothing back.
+// Returns the number of pages freed.
+int
+bshrink(int n)
+{
+  struct bpage *pg, **pp, **oldest;
+  int use, min, freed = 0;
 
+  if(holding(&bcache.lock))
+    return 0;
+  acquire(&bcache.lock);
+  while(freed < n && bcache.nbuf - (int)BPP >= NBUF){
+    oldest = 0;
+    min = 0;
+    for(pp = &bcache.pages; (pg = *pp) != 0; pp = &pg->next){
+      if((use = bpageuse(pg)) >= 0 && (oldest == 0 || use < min)){
+        oldest = pp;
+        min = use;
+      }
+    }
+    if(oldest == 0 || bpagefree(*oldest) == 0)
+      break;
+    pg = *oldest;
+    *oldest = pg->next;
+    bcache.nbuf -= BPP;
+    kfree(pg);
+    freed++;
+  }
+  release(&bcache.lock);
+  return freed;
+}
@@ -5,7 +5,9 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // ticks when refcnt last went to 0
+  int bucket;   // hash bucket it's on
+  struct buf *prev; // hash bucket list, by recent use
   struct buf *next;
   uchar data[BSIZE];
 };
@@ -8,14 +8,20 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bawrite(struct buf*);
+void            bawritev(struct buf**, int);
+void            bwait(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(int);
+int             bprefetch(uint, uint);
 
 // console.c
 void            consoleinit(void);
@@ -50,9 +56,11 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             itextreclaim(void);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+uint64          itext(struct inode*, uint, uint);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -63,6 +71,14 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void*           kalloc_zeroed(void);
+int             kzero_fill(void);
+void            kdup(void *);
+int             krefs(void *);
+int             kfreepages(void);
+void            ksplit(void *, int);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -104,12 +120,15 @@ void            userinit(void);
 int             wait(uint64, uint64);
 void            set_ps_priority(int);
 int             set_cfs_priority(int);
-void            get_cfs_stats(int, uint64);
+int             get_cfs_stats(int, uint64);
+int             sched_policy(int, int);
 void            wakeup(void*);
+void            wakeup_one(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+uint64          proc_satp(struct proc *);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -169,8 +188,22 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmfault(struct proc *, uint64, int);
+int             vmacopy(struct proc *, struct proc *);
+void            vmaclear(struct vma *);
+uint64          mmapbase(struct proc *);
+uint64          vmamap(struct proc *, uint64, int, int, struct inode *, uint);
+int             vmaunmap(struct proc *, uint64, uint64);
+void            vmaprefault(struct proc *, uint64, uint64);
+void            vmafree(struct proc *);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmmegapages(pagetable_t);
+void            uvminit(void);
+void            uvmpin(struct proc *);
+void            uvmunpin(struct proc *);
+int             uvmreclaim(void);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
@@ -187,7 +220,20 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_startv(struct buf **, int, int);
+int             virtio_disk_readahead(struct buf *);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
 
+// swap.c
+void            swapinit(int, struct superblock*);
+int             swapalloc(void);
+void            swapdup(int);
+void            swapfree(int);
+void            swapwrite(int, char *);
+void            swapread(int, char *);
+void            swapdump(void);
+
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -27,6 +27,10 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+  struct textpage *text; // shared read-only pages, or 0; see itext()
+  uint ranext;        // block after the last one readi() read
+  uint ramark;        // read ahead up to here
+  uint rawin;         // read-ahead window, in blocks
 };
 
 // map major device number to device functions.
@@ -44,6 +44,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  swapinit(dev, &sb);
 }
 
 // Zero a block.
@@ -190,6 +191,7 @@ iinit()
 }
 
 static struct inode* iget(uint dev, uint inum);
+static void itextfree(struct inode *ip);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -250,10 +252,12 @@ iget(uint dev, uint inum)
 
   acquire(&itable.lock);
 
-  // Is the inode already in the table?
+  // Is the inode already in the table? An entry with no
+  // references is still a good copy if it's valid, and
+  // keeps its text pages for the next exec().
   empty = 0;
   for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+    if((ip->ref > 0 || ip->valid) && ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
       return ip;
@@ -267,10 +271,14 @@ iget(uint dev, uint inum)
     panic("iget: no inodes");
 
   ip = empty;
+  itextfree(ip);
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = 0;
+  ip->ramark = 0;
+  ip->rawin = 0;
   release(&itable.lock);
 
   return ip;
@@ -450,6 +458,100 @@ itrunc(struct inode *ip)
 
   ip->size = 0;
   iupdate(ip);
+  itextfree(ip);
+}
+
+// One page of a file's contents, shared by every
+// process that maps it read-only.
+struct textpage {
+  uint64 pa;  // physical page, or 0
+  uint n;     // bytes of the file in it; the rest is zero
+};
+
+#define NTEXTPAGE ((MAXFILE*BSIZE + PGSIZE - 1) / PGSIZE)
+
+// Return a page holding the n bytes of ip at off, which
+// must be page-aligned, followed by zeroes. Pages are
+// cached in ip->text, so that every process exec()ing ip
+// maps the same physical text pages; each call adds a
+// reference for the caller to kfree().
+// Returns 0 on failure.
+// Caller must hold ip->lock.
+uint64
+itext(struct inode *ip, uint off, uint n)
+{
+  struct textpage *tp = 0;
+  char *mem;
+
+  if(off % PGSIZE != 0 || n > PGSIZE || off / PGSIZE >= NTEXTPAGE)
+    return 0;
+  if(ip->text == 0)
+    ip->text = kalloc_zeroed();
+  if(ip->text){
+    tp = &ip->text[off / PGSIZE];
+    if(tp->pa && tp->n == n){
+      kdup((void*)tp->pa);
+      return tp->pa;
+    }
+  }
+
+  if((mem = n == PGSIZE ? kalloc() : kalloc_zeroed()) == 0)
+    return 0;
+  if(readi(ip, 0, (uint64)mem, off, n) != n){
+    kfree(mem);
+    return 0;
+  }
+  // keep the new page's reference for the cache, unless a
+  // page of a different length (odd ELF layout) is there.
+  if(tp && tp->pa == 0){
+    tp->pa = (uint64)mem;
+    tp->n = n;
+    kdup(mem);
+  }
+  return (uint64)mem;
+}
+
+// Drop ip's cached text pages, e.g. because its
+// contents change or it leaves the inode table.
+// Pages still mapped by processes stay until unmapped.
+static void
+itextfree(struct inode *ip)
+{
+  if(ip->text == 0)
+    return;
+  for(int i = 0; i < NTEXTPAGE; i++)
+    if(ip->text[i].pa)
+      kfree((void*)ip->text[i].pa);
+  kfree(ip->text);
+  ip->text = 0;
+}
+
+// Drop the cached text pages of an inode that nobody
+// holds a reference to, to make room when memory runs out.
+// kalloc() calls this, so it must not be called with
+// itable.lock held.
+// Returns the number of pages freed, or 0 if none could be.
+int
+itextreclaim(void)
+{
+  struct inode *ip;
+  int i, n = 0;
+
+  if(holding(&itable.lock))
+    return 0;
+  acquire(&itable.lock);
+  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE] && n == 0; ip++){
+    if(ip->ref != 0 || ip->text == 0)
+      continue;
+    // pages still mapped by processes aren't freed.
+    for(i = 0; i < NTEXTPAGE; i++)
+      if(ip->text[i].pa && krefs((void*)ip->text[i].pa) == 1)
+        n++;
+    itextfree(ip);
+    n++;
+  }
+  release(&itable.lock);
+  return n;
 }
 
 // Copy stat information from inode.
@@ -464,6 +566,37 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Read-ahead. While readi() finds an inode being read
+// sequentially, it starts reading the next rawin blocks into
+// the buffer cache, doubling rawin with each sequential read
+// up to RAMAX, so they're there by the time they're wanted.
+#define RAMAX 16
+
+// readi() read blocks bn up to end of ip.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn, uint end)
+{
+  uint b, last, addr;
+
+  if(bn == ip->ranext || bn + 1 == ip->ranext){
+    ip->rawin = ip->rawin ? min(2 * ip->rawin, RAMAX) : 2;
+  } else {
+    ip->rawin = 0;
+    ip->ramark = 0;
+  }
+  ip->ranext = end;
+  if(ip->rawin == 0)
+    return;
+
+  last = min(end + ip->rawin, (ip->size + BSIZE - 1) / BSIZE);
+  for(b = end > ip->ramark ? end : ip->ramark; b < last; b++){
+    if((addr = bmap(ip, b)) == 0 || bprefetch(ip->dev, addr) < 0)
+      break;
+  }
+  ip->ramark = b;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -471,7 +604,7 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, start;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -479,6 +612,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  start = off;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
@@ -492,6 +626,8 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     }
     brelse(bp);
   }
+  if(tot != -1 && tot > 0)
+    readahead(ip, start/BSIZE, (off - 1)/BSIZE + 1);
   return tot;
 }
 
@@ -513,6 +649,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  itextfree(ip);
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
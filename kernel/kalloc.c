@@ -1,6 +1,17 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous blocks of 2^order pages.
+//
+// Underneath is a binary buddy allocator: a free block of
+// 2^k pages is aligned to its size (relative to KERNBASE),
+// and when it is freed next to its equally sized, free
+// "buddy", the two coalesce into a block of 2^(k+1) pages.
+// Single pages go through per-CPU caches on top of it.
+//
+// Build with KALLOC_JUNK=1 to fill freed and newly allocated
+// memory with junk, to catch dangling refs and callers that
+// assume zeroed pages.
 
 #include "types.h"
 #include "param.h"
@@ -14,52 +25,254 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+// a free page, or the first page of a free buddy block.
 struct run {
   struct run *next;
+  struct run *prev; // buddy free lists only
+};
+
+// pages move between a CPU's cache and the buddy
+// allocator KCACHE_BATCH at a time; a cache holding
+// more than KCACHE_HIGH pages gives a batch back.
+#define KCACHE_BATCH 32
+#define KCACHE_HIGH  64
+
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+// Per-page state, indexed by PA2PG(pa).
+struct page {
+  int ref;    // references to a kalloc()ed page; atomic
+  char free;  // first page of a free buddy block?
+  char order; // if so, the block's order
 };
 
 struct {
   struct spinlock lock;
-  struct run *freelist;
+  struct run freelist[MAXORDER+1]; // per order; circular, via prev/next
+  int nfree;                       // pages on the free lists
+  struct page page[NPAGE];
 } kmem;
 
+// Per-CPU caches of free pages, so that most kalloc()s and
+// kfree()s don't touch kmem.lock. A cache's lock is only
+// contended when another CPU steals from it.
+// Lock order: a kcache lock, then kmem.lock.
+struct kcache {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+} kcache[NCPU];
+
+// Pages zeroed ahead of time by idle CPUs, so that
+// kalloc_zeroed() usually needn't clear a page itself.
+// Holds at most about ZPOOL_HIGH pages.
+#define ZPOOL_HIGH 64
+
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+} zpool;
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int k = 0; k <= MAXORDER; k++)
+    kmem.freelist[k].next = kmem.freelist[k].prev = &kmem.freelist[k];
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcache[i].lock, "kcache");
+  initlock(&zpool.lock, "zpool");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Free [pa_start, pa_end) in the largest aligned
+// blocks that fit.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 p, e = (uint64)pa_end;
+  int k;
+
+  p = PGROUNDUP((uint64)pa_start);
+  while(p + PGSIZE <= e){
+    for(k = MAXORDER; k > 0; k--){
+      if((p - KERNBASE) % ((uint64)PGSIZE << k) == 0 && p + ((uint64)PGSIZE << k) <= e)
+        break;
+    }
+    kfree_order((void*)p, k);
+    p += (uint64)PGSIZE << k;
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Put the block of 2^order pages at pa on the buddy free
+// lists, merging it with its buddy for as long as that is free.
+// Caller must hold kmem.lock.
+static void
+buddy_free(uint64 pa, int order)
+{
+  uint64 buddy;
+  struct page *pg;
+  struct run *r;
+
+  kmem.nfree += 1 << order;
+  for(; order < MAXORDER; order++){
+    buddy = KERNBASE + ((pa - KERNBASE) ^ ((uint64)PGSIZE << order));
+    if(buddy < (uint64)end || buddy >= PHYSTOP)
+      break;
+    pg = &kmem.page[PA2PG(buddy)];
+    if(!pg->free || pg->order != order)
+      break;
+    // take the buddy off its list and merge.
+    r = (struct run*)buddy;
+    r->prev->next = r->next;
+    r->next->prev = r->prev;
+    pg->free = 0;
+    if(buddy < pa)
+      pa = buddy;
+  }
+
+  pg = &kmem.page[PA2PG(pa)];
+  pg->free = 1;
+  pg->order = order;
+  r = (struct run*)pa;
+  r->next = kmem.freelist[order].next;
+  r->prev = &kmem.freelist[order];
+  r->next->prev = r;
+  kmem.freelist[order].next = r;
+}
+
+// Take a block of 2^order pages off the buddy free lists,
+// splitting a larger block if need be. Returns 0 if there
+// is none.
+// Caller must hold kmem.lock.
+static uint64
+buddy_alloc(int order)
+{
+  struct run *r;
+  struct page *pg;
+  uint64 pa, half;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(kmem.freelist[k].next != &kmem.freelist[k])
+      break;
+  if(k > MAXORDER)
+    return 0;
+
+  r = kmem.freelist[k].next;
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  pa = (uint64)r;
+  kmem.page[PA2PG(pa)].free = 0;
+  kmem.nfree -= 1 << order;
+
+  // return the unused upper halves to the lower orders.
+  while(k > order){
+    k--;
+    half = pa + ((uint64)PGSIZE << k);
+    pg = &kmem.page[PA2PG(half)];
+    pg->free = 1;
+    pg->order = k;
+    r = (struct run*)half;
+    r->next = kmem.freelist[k].next;
+    r->prev = &kmem.freelist[k];
+    r->next->prev = r;
+    kmem.freelist[k].next = r;
+  }
+  return pa;
+}
+
+// Move up to a batch of pages from the buddy allocator to kc.
+// Caller must hold kc->lock.
+static void
+refill(struct kcache *kc)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  for(int i = 0; i < KCACHE_BATCH && (r = (struct run*)buddy_alloc(0)) != 0; i++){
+    r->next = kc->freelist;
+    kc->freelist = r;
+    kc->n++;
+  }
+  release(&kmem.lock);
+}
+
+// Give a batch of kc's pages back to the buddy allocator.
+// Caller must hold kc->lock.
+static void
+spill(struct kcache *kc)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  for(int i = 0; i < KCACHE_BATCH && (r = kc->freelist) != 0; i++){
+    kc->freelist = r->next;
+    kc->n--;
+    buddy_free((uint64)r, 0);
+  }
+  release(&kmem.lock);
+}
+
+// Take a page from another CPU's cache, when both
+// this CPU's cache and the buddy allocator are empty.
+// Must not hold any kcache lock.
+static struct run *
+steal(struct kcache *self)
+{
+  struct kcache *kc;
+  struct run *r = 0;
+
+  for(kc = kcache; kc < &kcache[NCPU] && r == 0; kc++){
+    if(kc == self)
+      continue;
+    acquire(&kc->lock);
+    if((r = kc->freelist) != 0){
+      kc->freelist = r->next;
+      kc->n--;
+    }
+    release(&kc->lock);
+  }
+  return r;
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which should have been returned by a call to
+// kalloc(), and free it if that was the last one.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kcache *kc;
+  int ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(&kmem.page[PA2PG(pa)].ref, 1);
+  if(ref > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: ref");
+
+#ifdef KALLOC_JUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kcache[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  if(++kc->n > KCACHE_HIGH)
+    spill(kc);
+  release(&kc->lock);
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +282,174 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kcache *kc;
+
+ again:
+  push_off();
+  kc = &kcache[cpuid()];
+  acquire(&kc->lock);
+  if(kc->freelist == 0)
+    refill(kc);
+  if((r = kc->freelist) != 0){
+    kc->freelist = r->next;
+    kc->n--;
+  }
+  release(&kc->lock);
+  if(r == 0)
+    r = steal(kc);
+  pop_off();
+
+  if(r == 0){
+    // last resort: a page set aside for kalloc_zeroed().
+    acquire(&zpool.lock);
+    if((r = zpool.freelist) != 0){
+      zpool.freelist = r->next;
+      zpool.n--;
+    }
+    release(&zpool.lock);
+  }
+
+  if(r == 0){
+    // make room by dropping unused blocks from the
+    // buffer cache, if it has any to spare, or the text
+    // pages of programs no longer running.
+    if(bshrink(8) > 0 || itextreclaim() > 0)
+      goto again;
+    return 0;
+  }
+  kmem.page[PA2PG(r)].ref = 1;
+#ifdef KALLOC_JUNK
+  memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Add a reference to a page returned by kalloc(),
+// e.g. when a copy-on-write fork shares it; each
+// reference is dropped with kfree().
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  __sync_fetch_and_add(&kmem.page[PA2PG(pa)].ref, 1);
+}
+
+// Turn a block from kalloc_order(order) into 2^order
+// pages, each to be freed separately with kfree().
+void
+ksplit(void *pa, int order)
+{
+  for(int i = 0; i < (1 << order); i++)
+    kmem.page[PA2PG(pa) + i].ref = 1;
+}
+
+// Number of references to a page returned by kalloc().
+int
+krefs(void *pa)
+{
+  return __atomic_load_n(&kmem.page[PA2PG(pa)].ref, __ATOMIC_SEQ_CST);
+}
+
+// Roughly how many pages kalloc() could hand out now.
+int
+kfreepages(void)
+{
+  int n = kmem.nfree + zpool.n;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kcache[i].n;
+  return n;
+}
+
+// Allocate one 4096-byte page of zeroed physical memory.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  acquire(&zpool.lock);
+  if((r = zpool.freelist) != 0){
+    zpool.freelist = r->next;
+    zpool.n--;
+  }
+  release(&zpool.lock);
+
+  if(r){
+    r->next = 0; // the rest of the page is still zero
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Zero one page into the pool for kalloc_zeroed(),
+// unless the pool is already full. Called by idle CPUs.
+// Returns 1 if it did some work, 0 if not.
+int
+kzero_fill(void)
+{
+  struct run *r;
+
+  // don't take the last free pages, which kalloc() would
+  // then shrink the buffer cache to replace.
+  if(zpool.n >= ZPOOL_HIGH || kfreepages() - zpool.n < KCACHE_BATCH)
+    return 0;
+  if((r = kalloc()) == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+
+  acquire(&zpool.lock);
+  r->next = zpool.freelist;
+  zpool.freelist = r;
+  zpool.n++;
+  release(&zpool.lock);
+  return 1;
+}
+
+// Free the 2^order physically contiguous pages at pa,
+// which must have come from kalloc_order(order).
+void
+kfree_order(void *pa, int order)
+{
+  uint64 sz = (uint64)PGSIZE << order;
+
+  if(order < 0 || order > MAXORDER || ((uint64)pa - KERNBASE) % sz != 0 ||
+     (char*)pa < end || (uint64)pa + sz > PHYSTOP)
+    panic("kfree_order");
+
+#ifdef KALLOC_JUNK
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, sz);
+#endif
 
   acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  buddy_free((uint64)pa, order);
   release(&kmem.lock);
+}
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
-  return (void*)r;
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Order 0 is the same as kalloc().
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_order(int order)
+{
+  uint64 pa;
+
+  if(order == 0)
+    return kalloc();
+  if(order < 0 || order > MAXORDER)
+    return 0;
+
+  acquire(&kmem.lock);
+  pa = buddy_alloc(order);
+  release(&kmem.lock);
+
+#ifdef KALLOC_JUNK
+  if(pa)
+    memset((char*)pa, 5, (uint64)PGSIZE << order); // fill with junk
+#endif
+  return (void*)pa;
 }
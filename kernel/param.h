@@ -1,6 +1,7 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
+#define NVMA         16  // file-backed regions per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
@@ -8,6 +9,11 @@
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+// minimum size of disk block cache: a commit holds LOGSIZE
+// pinned buffers plus LOGSIZE log buffers being written, and
+// the rest leaves room for reads and read-ahead meanwhile.
+#define NBUF         (LOGSIZE*2+32)
 #define FSSIZE       2000  // size of file system in blocks
+#define SWAPSIZE     65536 // size of swap area after the file system, in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10  // largest kalloc_order() block is 2^MAXORDER pages
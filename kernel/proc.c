@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "sched.h"
 
 struct cpu cpus[NCPU];
 
@@ -15,11 +16,49 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// CFS vruntime grows at cfs_decay[cfs_priority] percent
+// of real time: 0 is high priority, 1 normal, 2 low.
+static uint64 cfs_decay[] = {75, 100, 125};
+
+// nanoseconds per unit of the time CSR (qemu's 10 MHz timebase).
+#define NS_PER_TIME 100
+
+// how far behind the run queue's min_vruntime a waking
+// process may start, in time CSR units (half a clock tick).
+#define CFS_WAKEUP_CREDIT 500000
+
+// Sleeping processes, hashed by the channel they sleep on.
+// A process is on its channel's list exactly while it is
+// SLEEPING. A sleep queue's lock must be acquired before
+// any p->lock.
+#define NSLEEPQ 61
+#define SLEEPQHASH(chan) ((uint64)(chan) % NSLEEPQ)
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void runq_push(struct proc *p, int woken);
 
 extern char trampoline[]; // trampoline.S
 
+// Address-space identifiers. A user page table is tagged
+// with its process's ASID in satp, so the TLB can hold its
+// translations alongside the kernel's and other processes',
+// and entering or leaving user space needs no flush.
+// ASIDs are handed out in generations: when they run out,
+// a new generation starts, and each CPU flushes its TLB
+// before it first uses an ASID of the new generation.
+// ASID 0 is the kernel's.
+struct {
+  struct spinlock lock;
+  uint64 gen;   // current generation, above the ASID bits
+  uint64 next;  // next unused ASID of this generation
+  uint64 max;   // largest ASID; 0 if the hardware has none
+} asids;
+
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
@@ -43,63 +82,30 @@ proc_mapstacks(pagetable_t kpgtbl)
   }
 }
 
-void update_ticks()
+// Charge the time since p's last state change to the
+// state it is leaving, and move it to state.
+// Caller must hold p->lock.
+static void
+setstate(struct proc *p, enum procstate state)
 {
-  struct proc *p;
-  for (p = proc; p < &proc[NPROC]; p++)
-  {
-    acquire(&p->lock);
-    switch (p->state)
-    {
-    case SLEEPING:
-      p->stime++;
-      break;
-    case RUNNABLE:
-      p->retime++;
-      break;
-    case RUNNING:
-      p->rtime++;
-      break;
-    default:
-      break;
-    }
-    release(&p->lock);
-  }
-}
+  uint64 now = r_time();
 
-// Find minimum value of the accumulators of all the runnable/running processes
-int
-getMinAccumulator(void)
-{
-  struct proc *p;
-  int min = 0;
-  for (p = proc; p < &proc[NPROC]; p++){
-    if (p->state == RUNNABLE || p->state == RUNNING){
-      if (min == 0 || p->accumulator < min)
-      {
-        min = p->accumulator;
-      }
-    }
-  }
-  return min;
-}
-// find the minimun vruntime of all the runnable/running processes
-int getMinVruntime(void)
-{
-  struct proc *p;
-  int min = 0;
-  for (p = proc; p < &proc[NPROC]; p++)
+  switch (p->state)
   {
-    if (p->state == RUNNABLE || p->state == RUNNING)
-    {
-      int decay = 75 ? p->cfs_priority == 0 : 100 ? p->cfs_priority == 1
-                                                  : 125;
-      int vruntime = (decay * (p->rtime)) / ((p->rtime) + (p->stime) + (p->retime));
-      if (min == 0 || vruntime < min)
-        min = vruntime;
-    }
+  case SLEEPING:
+    p->stime += now - p->tstamp;
+    break;
+  case RUNNABLE:
+    p->retime += now - p->tstamp;
+    break;
+  case RUNNING:
+    p->rtime += now - p->tstamp;
+    break;
+  default:
+    break;
   }
-  return min;
+  p->tstamp = now;
+  p->state = state;
 }
 
 // initialize the proc table.
@@ -107,15 +113,66 @@ void
  procinit(void)
 {
   struct proc *p;
+  struct cpu *c;
 
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for (c = cpus; c < &cpus[NCPU]; c++)
+    initlock(&c->rq.lock, "runq");
+  for (int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
   for (p = proc; p < &proc[NPROC]; p++)
   {
     initlock(&p->lock, "proc");
+    initlock(&p->vmlock, "vm");
     p->state = UNUSED;
     p->kstack = KSTACK((int)(p - proc));
   }
+
+  // see how many ASID bits the hardware implements
+  // by writing all ones and reading back.
+  initlock(&asids.lock, "asids");
+  w_satp(r_satp() | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+  asids.max = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+  w_satp(r_satp() & ~(SATP_ASID_MASK << SATP_ASID_SHIFT));
+  sfence_vma();
+  asids.gen = SATP_ASID_MASK + 1;
+  asids.next = 1;
+}
+
+// The satp value for running p in user space. Gives p a
+// new ASID if it has none, or one of an old generation,
+// and flushes this CPU's TLB if it hasn't been since the
+// current generation started.
+// Must be called with interrupts disabled.
+uint64
+proc_satp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  if (asids.max == 0)
+    return MAKE_SATP(p->pagetable); // trampoline.S flushes instead
+
+  acquire(&asids.lock);
+  if ((p->asid & ~SATP_ASID_MASK) != asids.gen)
+  {
+    if (asids.next > asids.max)
+    {
+      asids.gen += SATP_ASID_MASK + 1;
+      asids.next = 1;
+    }
+    p->asid = asids.gen | asids.next++;
+  }
+  gen = asids.gen;
+  release(&asids.lock);
+
+  if (c->asidgen != gen)
+  {
+    sfence_vma();
+    c->asidgen = gen;
+  }
+  return MAKE_SATP(p->pagetable) | ((p->asid & SATP_ASID_MASK) << SATP_ASID_SHIFT);
 }
 
 // Must be called with interrupts disabled,
@@ -186,6 +243,10 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->tstamp = r_time();
+  p->cpu = cpuid();
+  p->policy = SCHED_GLOBAL;
+  p->vruntime = 0;
 
   // Allocate a trapframe page.
   if ((p->trapframe = (struct trapframe *)kalloc()) == 0)
@@ -225,6 +286,8 @@ freeproc(struct proc *p)
   if (p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
+  p->asid = 0;
+  p->vmpin = 0;
   p->sz = 0;
   p->pid = 0;
   p->parent = 0;
@@ -312,8 +375,6 @@ void userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
-
   // TASK 5
   p->ps_priority = 5;
   p->accumulator = 0;
@@ -324,6 +385,9 @@ void userinit(void)
   p->stime = 0;
   p->retime = 0;
 
+  setstate(p, RUNNABLE);
+  runq_push(p, 1);
+
   release(&p->lock);
 }
 
@@ -337,14 +401,18 @@ int growproc(int n)
   sz = p->sz;
   if (n > 0)
   {
-    if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0)
+    // pages are allocated lazily, by uvmfault() on first use.
+    if (sz + n > mmapbase(p))
     {
       return -1;
     }
+    sz += n;
   }
   else if (n < 0)
   {
+    uvmpin(p);
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    uvmunpin(p);
   }
   p->sz = sz;
   return 0;
@@ -365,13 +433,17 @@ int fork(void)
   }
 
   // Copy user memory from parent to child.
-  if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0)
+  np->sz = p->sz;
+  uvmpin(p);
+  if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0 ||
+      vmacopy(p, np) < 0)
   {
+    uvmunpin(p);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+  uvmunpin(p);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -395,20 +467,23 @@ int fork(void)
   np->parent = p;
   release(&wait_lock);
 
-  acquire(&np->lock);
-  np->state = RUNNABLE;
-  release(&np->lock);
-
   // TASK 5
   np->ps_priority = 5;
-  np->accumulator = getMinAccumulator();
 
   // TASK 6
   np->cfs_priority = p->cfs_priority;
+  np->vruntime = p->vruntime;
+
+  np->policy = p->policy;
   np->rtime = 0;
   np->stime = 0;
   np->retime = 0;
 
+  acquire(&np->lock);
+  setstate(np, RUNNABLE);
+  runq_push(np, 1);
+  release(&np->lock);
+
   return pid;
 }
 
@@ -431,7 +506,8 @@ void reparent(struct proc *p)
 void set_ps_priority(int priority)
 {
   struct proc *p = myproc();
-  p->ps_priority = priority;
+  if (1 <= priority && priority <= NPRIO)
+    p->ps_priority = priority;
 }
 
 int set_cfs_priority(int priority)
@@ -456,6 +532,34 @@ struct proc *getProc(int pid)
   return 0;
 }
 
+// Copy pid's cfs_priority and its run, sleep and runnable
+// times in nanoseconds, as four uint64s, to the calling
+// process's address addr.
+// Returns 0 on success, -1 on error.
+int
+get_cfs_stats(int pid, uint64 addr)
+{
+  struct proc *p;
+  uint64 st[4];
+
+  if ((p = getProc(pid)) == 0)
+    return -1;
+  acquire(&p->lock);
+  if (p->pid != pid || p->state == UNUSED)
+  {
+    release(&p->lock);
+    return -1;
+  }
+  // include the time spent so far in the current state.
+  setstate(p, p->state);
+  st[0] = p->cfs_priority;
+  st[1] = p->rtime * NS_PER_TIME;
+  st[2] = p->stime * NS_PER_TIME;
+  st[3] = p->retime * NS_PER_TIME;
+  release(&p->lock);
+  return copyout(myproc()->pagetable, addr, (char *)st, sizeof(st));
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait().
@@ -479,6 +583,11 @@ exit(int status, char *msg)
     }
   }
 
+  // keep the page reclaimer away for good: once p is a
+  // zombie, wait() frees its memory.
+  uvmpin(p);
+  vmafree(p);
+
   begin_op();
   iput(p->cwd);
   end_op();
@@ -495,7 +604,7 @@ exit(int status, char *msg)
   acquire(&p->lock);
 
   p->xstate = status;
-  p->state = ZOMBIE;
+  setstate(p, ZOMBIE);
 
   release(&wait_lock);
 
@@ -509,7 +618,8 @@ exit(int status, char *msg)
 int wait(uint64 addr, uint64 p_exit_msg)
 {
   struct proc *pp;
-  int havekids, pid;
+  int havekids, pid, xstate;
+  char msg[32];
   struct proc *p = myproc();
 
   acquire(&wait_lock);
@@ -528,19 +638,20 @@ int wait(uint64 addr, uint64 p_exit_msg)
         havekids = 1;
         if (pp->state == ZOMBIE)
         {
-          // Found one.
+          // Found one. Copy out its status after
+          // releasing the locks, since copyout() may
+          // page in from disk.
           pid = pp->pid;
-          if (addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                   sizeof(pp->xstate)) < 0)
-          {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          copyout(p->pagetable, p_exit_msg, (char *)&pp->exit_msg, 32);
+          xstate = pp->xstate;
+          memmove(msg, pp->exit_msg, sizeof(msg));
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
+          if (addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                   sizeof(xstate)) < 0)
+            return -1;
+          if (p_exit_msg != 0)
+            copyout(p->pagetable, p_exit_msg, msg, sizeof(msg));
           return pid;
         }
         release(&pp->lock);
@@ -559,90 +670,655 @@ int wait(uint64 addr, uint64 p_exit_msg)
   }
 }
 
-void defaulScheduler(struct cpu *c, struct proc *p)
+// CFS run queue: a red-black tree of processes ordered by
+// vruntime, with the leftmost (smallest) node cached so that
+// picking the next process is O(1) and insertion O(log n).
+// Equal keys go to the right, so ties run in FIFO order.
+// Caller must hold rq->lock for all of the rb_* functions.
+
+static void
+rb_rotate_left(struct runq *rq, struct proc *x)
+{
+  struct proc *y = x->rb_right;
+
+  x->rb_right = y->rb_left;
+  if (y->rb_left)
+    y->rb_left->rb_parent = x;
+  y->rb_parent = x->rb_parent;
+  if (x->rb_parent == 0)
+    rq->root = y;
+  else if (x == x->rb_parent->rb_left)
+    x->rb_parent->rb_left = y;
+  else
+    x->rb_parent->rb_right = y;
+  y->rb_left = x;
+  x->rb_parent = y;
+}
+
+static void
+rb_rotate_right(struct runq *rq, struct proc *x)
+{
+  struct proc *y = x->rb_left;
+
+  x->rb_left = y->rb_right;
+  if (y->rb_right)
+    y->rb_right->rb_parent = x;
+  y->rb_parent = x->rb_parent;
+  if (x->rb_parent == 0)
+    rq->root = y;
+  else if (x == x->rb_parent->rb_right)
+    x->rb_parent->rb_right = y;
+  else
+    x->rb_parent->rb_left = y;
+  y->rb_right = x;
+  x->rb_parent = y;
+}
+
+static void
+rb_insert(struct runq *rq, struct proc *p)
+{
+  struct proc **link = &rq->root, *parent = 0, *g, *u;
+  int leftmost = 1;
+
+  while (*link)
+  {
+    parent = *link;
+    if (p->vruntime < parent->vruntime)
+      link = &parent->rb_left;
+    else
+    {
+      link = &parent->rb_right;
+      leftmost = 0;
+    }
+  }
+  p->rb_parent = parent;
+  p->rb_left = p->rb_right = 0;
+  p->rb_red = 1;
+  *link = p;
+  if (leftmost)
+    rq->leftmost = p;
+
+  // a red node may not have a red parent.
+  while ((parent = p->rb_parent) != 0 && parent->rb_red)
+  {
+    g = parent->rb_parent; // exists, since the root is black.
+    if (parent == g->rb_left)
+    {
+      u = g->rb_right;
+      if (u && u->rb_red)
+      {
+        parent->rb_red = u->rb_red = 0;
+        g->rb_red = 1;
+        p = g;
+        continue;
+      }
+      if (p == parent->rb_right)
+      {
+        rb_rotate_left(rq, parent);
+        p = parent;
+        parent = p->rb_parent;
+      }
+      parent->rb_red = 0;
+      g->rb_red = 1;
+      rb_rotate_right(rq, g);
+    }
+    else
+    {
+      u = g->rb_left;
+      if (u && u->rb_red)
+      {
+        parent->rb_red = u->rb_red = 0;
+        g->rb_red = 1;
+        p = g;
+        continue;
+      }
+      if (p == parent->rb_left)
+      {
+        rb_rotate_right(rq, parent);
+        p = parent;
+        parent = p->rb_parent;
+      }
+      parent->rb_red = 0;
+      g->rb_red = 1;
+      rb_rotate_left(rq, g);
+    }
+  }
+  rq->root->rb_red = 0;
+}
+
+// replace the subtree rooted at u with the one rooted at v.
+static void
+rb_transplant(struct runq *rq, struct proc *u, struct proc *v)
+{
+  if (u->rb_parent == 0)
+    rq->root = v;
+  else if (u == u->rb_parent->rb_left)
+    u->rb_parent->rb_left = v;
+  else
+    u->rb_parent->rb_right = v;
+  if (v)
+    v->rb_parent = u->rb_parent;
+}
+
+static int
+rb_isred(struct proc *p)
+{
+  return p != 0 && p->rb_red;
+}
+
+static void
+rb_erase(struct runq *rq, struct proc *z)
+{
+  struct proc *y, *x, *xp, *w;
+  int red = z->rb_red;
+
+  if (rq->leftmost == z)
+  {
+    // z has no left child, so the next smallest is the
+    // minimum of its right subtree, or else its parent.
+    if ((y = z->rb_right) != 0)
+      while (y->rb_left)
+        y = y->rb_left;
+    else
+      y = z->rb_parent;
+    rq->leftmost = y;
+  }
+
+  if (z->rb_left == 0)
+  {
+    x = z->rb_right;
+    xp = z->rb_parent;
+    rb_transplant(rq, z, x);
+  }
+  else if (z->rb_right == 0)
+  {
+    x = z->rb_left;
+    xp = z->rb_parent;
+    rb_transplant(rq, z, x);
+  }
+  else
+  {
+    y = z->rb_right;
+    while (y->rb_left)
+      y = y->rb_left;
+    red = y->rb_red;
+    x = y->rb_right;
+    if (y->rb_parent == z)
+      xp = y;
+    else
+    {
+      xp = y->rb_parent;
+      rb_transplant(rq, y, x);
+      y->rb_right = z->rb_right;
+      y->rb_right->rb_parent = y;
+    }
+    rb_transplant(rq, z, y);
+    y->rb_left = z->rb_left;
+    y->rb_left->rb_parent = y;
+    y->rb_red = z->rb_red;
+  }
+  z->rb_parent = z->rb_left = z->rb_right = 0;
+  if (red)
+    return;
+
+  // a black node was removed; x (possibly null, child of xp)
+  // carries an extra black that must be pushed up or absorbed.
+  while (x != rq->root && !rb_isred(x))
+  {
+    if (x == xp->rb_left)
+    {
+      w = xp->rb_right;
+      if (w->rb_red)
+      {
+        w->rb_red = 0;
+        xp->rb_red = 1;
+        rb_rotate_left(rq, xp);
+        w = xp->rb_right;
+      }
+      if (!rb_isred(w->rb_left) && !rb_isred(w->rb_right))
+      {
+        w->rb_red = 1;
+        x = xp;
+        xp = x->rb_parent;
+      }
+      else
+      {
+        if (!rb_isred(w->rb_right))
+        {
+          w->rb_left->rb_red = 0;
+          w->rb_red = 1;
+          rb_rotate_right(rq, w);
+          w = xp->rb_right;
+        }
+        w->rb_red = xp->rb_red;
+        xp->rb_red = 0;
+        w->rb_right->rb_red = 0;
+        rb_rotate_left(rq, xp);
+        x = rq->root;
+      }
+    }
+    else
+    {
+      w = xp->rb_left;
+      if (w->rb_red)
+      {
+        w->rb_red = 0;
+        xp->rb_red = 1;
+        rb_rotate_right(rq, xp);
+        w = xp->rb_left;
+      }
+      if (!rb_isred(w->rb_left) && !rb_isred(w->rb_right))
+      {
+        w->rb_red = 1;
+        x = xp;
+        xp = x->rb_parent;
+      }
+      else
+      {
+        if (!rb_isred(w->rb_left))
+        {
+          w->rb_right->rb_red = 0;
+          w->rb_red = 1;
+          rb_rotate_left(rq, w);
+          w = xp->rb_left;
+        }
+        w->rb_red = xp->rb_red;
+        xp->rb_red = 0;
+        w->rb_left->rb_red = 0;
+        rb_rotate_right(rq, xp);
+        x = rq->root;
+      }
+    }
+  }
+  if (x)
+    x->rb_red = 0;
+}
+
+// A scheduling class: one policy's share of each CPU's run
+// queue. Every run queue holds the structures of all classes,
+// so a process stays where it was queued until it is picked,
+// and a change of policy takes effect at its next enqueue.
+// Caller must hold rq->lock for all of these.
+struct sched_class {
+  char *name;
+  // add p; woken is 1 if p was not RUNNABLE before.
+  void (*enqueue)(struct runq *rq, struct proc *p, int woken);
+  // remove and return the next process to run, or 0.
+  struct proc *(*pick)(struct runq *rq);
+  // p, just picked from one queue, will run from another.
+  void (*migrate)(struct proc *p, struct runq *from, struct runq *to);
+};
+
+// Round robin: a FIFO list.
+static void
+defaultEnqueue(struct runq *rq, struct proc *p, int woken)
+{
+  p->rqnext = 0;
+  if (rq->tail)
+    rq->tail->rqnext = p;
+  else
+    rq->head = p;
+  rq->tail = p;
+}
+
+// Take the process that has waited longest.
+static struct proc *
+defaulScheduler(struct runq *rq)
+{
+  struct proc *p = rq->head;
+
+  if (p)
+  {
+    rq->head = p->rqnext;
+    if (rq->head == 0)
+      rq->tail = 0;
+    p->rqnext = 0;
+  }
+  return p;
+}
+
+// Priority: one list per ps_priority level, and a bitmap of
+// the non-empty levels. Each level stays sorted by accumulator:
+// a woken process starts at the queue's minimum, so it goes
+// first; a preempted one was the minimum and has since grown by
+// its priority, which no other process at its level can exceed,
+// so it goes last.
+static void
+priorityEnqueue(struct runq *rq, struct proc *p, int woken)
+{
+  int i = p->ps_priority - 1;
+
+  if (woken)
+  {
+    p->accumulator = rq->min_accumulator;
+    p->rqnext = rq->prio[i];
+    if (rq->prio[i] == 0)
+      rq->priotail[i] = p;
+    rq->prio[i] = p;
+  }
+  else
+  {
+    p->rqnext = 0;
+    if (rq->prio[i])
+      rq->priotail[i]->rqnext = p;
+    else
+      rq->prio[i] = p;
+    rq->priotail[i] = p;
+  }
+  rq->prioready |= 1 << i;
+}
+
+// Take the queued process with the smallest accumulator,
+// preferring the lower level on a tie. Each level is sorted,
+// so only the head of each non-empty level is examined.
+static struct proc *
+priorityScheduler(struct runq *rq)
 {
-  if (p->state == RUNNABLE)
+  struct proc *best = 0;
+  uint m;
+  int i, besti = 0;
+
+  for (i = 0, m = rq->prioready; m; i++, m >>= 1)
+  {
+    if ((m & 1) && (best == 0 || rq->prio[i]->accumulator < best->accumulator))
+    {
+      best = rq->prio[i];
+      besti = i;
+    }
+  }
+  if (best)
   {
-    p->state = RUNNING;
-    c->proc = p;
-    swtch(&c->context, &p->context);
-    // Process is done running for now.
-    // It should have changed its p->state before coming back.
-    c->proc = 0;
+    rq->prio[besti] = best->rqnext;
+    if (rq->prio[besti] == 0)
+    {
+      rq->priotail[besti] = 0;
+      rq->prioready &= ~(1 << besti);
+    }
+    best->rqnext = 0;
+    if (best->accumulator > rq->min_accumulator)
+      rq->min_accumulator = best->accumulator;
   }
+  return best;
+}
+
+// accumulators are relative to their queue's minimum;
+// keep p's lag behind it.
+static void
+priorityMigrate(struct proc *p, struct runq *from, struct runq *to)
+{
+  long long lag = 0;
+
+  if (p->accumulator > from->min_accumulator)
+    lag = p->accumulator - from->min_accumulator;
+  p->accumulator = to->min_accumulator + lag;
 }
-void priorityScheduler(struct cpu *c, struct proc *p)
+
+// CFS: the red-black tree.
+static void
+cfsEnqueue(struct runq *rq, struct proc *p, int woken)
 {
-  long long acc = getMinAccumulator();
-  if (p->state == RUNNABLE && p->accumulator == acc)
+  // a process that slept, or a new child, must not be so far
+  // behind the others that it monopolizes the CPU while it
+  // catches up: its lead over min_vruntime is capped.
+  if (p->vruntime + CFS_WAKEUP_CREDIT < rq->min_vruntime)
+    p->vruntime = rq->min_vruntime - CFS_WAKEUP_CREDIT;
+  rb_insert(rq, p);
+}
+
+// Take the queued process with the smallest vruntime,
+// and advance the queue's min_vruntime to it.
+static struct proc *
+cfsScheduler(struct runq *rq)
+{
+  struct proc *p = rq->leftmost;
+
+  if (p)
+  {
+    rb_erase(rq, p);
+    if (p->vruntime > rq->min_vruntime)
+      rq->min_vruntime = p->vruntime;
+  }
+  return p;
+}
+
+// vruntimes are relative to their queue's min_vruntime;
+// keep p's lag behind it.
+static void
+cfsMigrate(struct proc *p, struct runq *from, struct runq *to)
+{
+  uint64 lag = 0;
+
+  if (p->vruntime > from->min_vruntime)
+    lag = p->vruntime - from->min_vruntime;
+  p->vruntime = to->min_vruntime + lag;
+}
+
+// indexed by SCHED_* policy number.
+static struct sched_class sched_classes[] = {
+[SCHED_DEFAULT]  { "default", defaultEnqueue, defaulScheduler, 0 },
+[SCHED_PRIORITY] { "priority", priorityEnqueue, priorityScheduler, priorityMigrate },
+[SCHED_CFS]      { "cfs", cfsEnqueue, cfsScheduler, cfsMigrate },
+};
+
+// the policy of processes that have not chosen their own.
+static int sched_global = SCHED_CFS;
+
+// the policy p is scheduled under.
+static int
+policyof(struct proc *p)
+{
+  if (p->policy == SCHED_GLOBAL)
+    return sched_global;
+  return p->policy;
+}
+
+// Send an IPI to wake CPU c from wfi in scheduler().
+// timervec in kernelvec.S turns it into a supervisor
+// software interrupt, which devintr() ignores.
+// Must be called with interrupts disabled.
+static void
+kick(struct cpu *c)
+{
+  if (c != mycpu())
+    *(uint32 *)CLINT_MSIP(c - cpus) = 1;
+}
+
+// Append p to the run queue of the CPU it last ran on,
+// in its scheduling class.
+// woken is 1 if p has just become RUNNABLE (a new child,
+// or woken from sleep), and 0 if it was preempted.
+// p->state must already be RUNNABLE.
+// Caller must hold p->lock.
+static void
+runq_push(struct proc *p, int woken)
+{
+  struct cpu *c = &cpus[p->cpu], *o;
+  struct runq *rq = &c->rq;
+  int n;
+
+  acquire(&rq->lock);
+  sched_classes[policyof(p)].enqueue(rq, p, woken);
+  n = ++rq->n;
+  release(&rq->lock);
+
+  // wake p's CPU if it is idle. if it is busy and work is
+  // piling up, wake some idle CPU to steal it instead.
+  if (c->idle)
+    kick(c);
+  else if (n > 1)
+  {
+    for (o = cpus; o < &cpus[NCPU]; o++)
+    {
+      if (o->idle)
+      {
+        kick(o);
+        break;
+      }
+    }
+  }
+}
+
+// Remove the next process to run from rq, or return 0 if
+// rq is empty. The global policy's class goes first; processes
+// that chose another class run when it has nothing to offer.
+// Sets *cls to the class p came from.
+static struct proc *
+runq_pop(struct runq *rq, int *cls)
+{
+  struct proc *p;
+  int i;
+
+  acquire(&rq->lock);
+  *cls = sched_global;
+  p = sched_classes[*cls].pick(rq);
+  for (i = 0; p == 0 && i < NELEM(sched_classes); i++)
   {
-    p->state = RUNNING;
-    c->proc = p;
-    swtch(&c->context, &p->context);
+    if (i != sched_global && (p = sched_classes[i].pick(rq)) != 0)
+      *cls = i;
+  }
+  if (p)
+    rq->n--;
+  release(&rq->lock);
+  return p;
+}
+
+// Called by a CPU whose own run queue is empty:
+// take a process from the busiest other run queue.
+static struct proc *
+runq_steal(struct cpu *c)
+{
+  struct cpu *o, *victim = 0;
+  struct proc *p;
+  int most = 0, cls;
 
-    // Process is done running for now.
-    // It should have changed its p->state before coming back.
-    c->proc = 0;
+  // the lengths are read without locks; they are only
+  // a hint, and runq_pop() re-checks under the lock.
+  for (o = cpus; o < &cpus[NCPU]; o++)
+  {
+    if (o != c && o->rq.n > most)
+    {
+      most = o->rq.n;
+      victim = o;
+    }
   }
+  if (victim == 0 || (p = runq_pop(&victim->rq, &cls)) == 0)
+    return 0;
+  if (sched_classes[cls].migrate)
+    sched_classes[cls].migrate(p, &victim->rq, &c->rq);
+  return p;
 }
-void cfsScheduler(struct cpu *c, struct proc *p)
+
+// Set the scheduling policy of process pid, or of the
+// whole system if pid is 0. SCHED_GLOBAL returns a process
+// to following the system's policy.
+// Returns 0 on success, -1 on error.
+int
+sched_policy(int pid, int policy)
 {
-  int min = getMinVruntime();
-  int decay = 75 ? p->cfs_priority == 0 : 
-              100 ? p->cfs_priority == 1 :
-              125;
-  int vruntime = (decay * p->rtime) / (p->rtime + p->stime + p->retime);
-  if (p->state == RUNNABLE && vruntime == min)
+  struct proc *p;
+
+  if (policy < SCHED_GLOBAL || policy >= (int)NELEM(sched_classes))
+    return -1;
+
+  if (pid == 0)
   {
-    p->state = RUNNING;
-    c->proc = p;
-    swtch(&c->context, &p->context);
+    if (policy == SCHED_GLOBAL)
+      return -1;
+    // processes already queued stay in their old class's
+    // structure until picked, and are then re-queued
+    // under the new policy.
+    sched_global = policy;
+    return 0;
+  }
 
-    // Process is done running for now.
-    // It should have changed its p->state before coming back.
-    c->proc = 0;
+  for (p = proc; p < &proc[NPROC]; p++)
+  {
+    acquire(&p->lock);
+    if (p->pid == pid && p->state != UNUSED)
+    {
+      p->policy = policy;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
   }
+  return -1;
 }
 
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process off this CPU's run queue,
+//    or steal one from the busiest other CPU.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
-//    via swtch back to the scheduler.
+//    via swtch back to the scheduler, which puts
+//    it back on the run queue if it is still RUNNABLE.
 void scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  uint64 ran, idle;
+  int cls;
   c->proc = 0;
 
-  int SCHEDULER_TYPE = 2; // 0 for Default, 1 for Priority, 2 for CFS
   for (;;)
   {
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for (p = proc; p < &proc[NPROC]; p++)
+    if ((p = runq_pop(&c->rq, &cls)) == 0 && (p = runq_steal(c)) == 0)
+    {
+      // Use idle time to zero pages for kalloc_zeroed(),
+      // one at a time so a newly runnable process waits
+      // for at most one page.
+      if (kzero_fill())
+        continue;
+
+      // Nothing to run: wait for an interrupt instead of
+      // spinning. runq_push() sees c->idle and kicks us;
+      // re-check the queue after setting it, so that a
+      // push which missed the flag isn't lost. wfi returns
+      // on a pending interrupt even with interrupts off,
+      // and the handler runs at the top of the loop, so
+      // one can't slip in between the check and the wfi.
+      c->idle = 1;
+      intr_off();
+      __sync_synchronize();
+      if (c->rq.n == 0)
+      {
+        idle = r_time();
+        wfi();
+        c->idletime += r_time() - idle;
+      }
+      c->idle = 0;
+      continue;
+    }
+
+    acquire(&p->lock);
+    if (p->state == RUNNABLE)
     {
-      acquire(&p->lock);
       // Switch to chosen process.  It is the process's job
       // to release its lock and then reacquire it
       // before jumping back to us.
-      switch (SCHEDULER_TYPE)
-      {
-      case 0:
-        defaulScheduler(c, p);
-        break;
-      case 1:
-        priorityScheduler(c, p);
-        break;
-      case 2:
-        cfsScheduler(c, p);
-        break;
-      }
-      release(&p->lock);
+      setstate(p, RUNNING);
+      p->cpu = c - cpus;
+      c->proc = p;
+      ran = p->rtime;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
+
+      // charge the time it ran, scaled by its CFS priority.
+      p->vruntime += (p->rtime - ran) * cfs_decay[p->cfs_priority] / 100;
+
+      // yield() leaves the process RUNNABLE.
+      if (p->state == RUNNABLE)
+        runq_push(p, 0);
     }
+    release(&p->lock);
   }
 }
 
@@ -677,7 +1353,7 @@ void yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setstate(p, RUNNABLE);
   sched();
   release(&p->lock);
 }
@@ -708,20 +1384,25 @@ void forkret(void)
 void sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq = &sleepq[SLEEPQHASH(chan)];
 
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold chan's sleep queue lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the sleep queue),
   // so it's okay to release lk.
 
+  acquire(&sq->lock);
   acquire(&p->lock); // DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
-  p->state = SLEEPING;
+  setstate(p, SLEEPING);
+  p->sqnext = sq->head;
+  sq->head = p;
+  release(&sq->lock);
 
   sched();
 
@@ -733,51 +1414,56 @@ void sleep(void *chan, struct spinlock *lk)
   acquire(lk);
 }
 
+// Make p, which was sleeping on sq, RUNNABLE.
+// pp is the link that points to p.
+// Caller must hold sq->lock.
+static void
+sleepq_wake(struct proc **pp, struct proc *p)
+{
+  *pp = p->sqnext;
+  p->sqnext = 0;
+  acquire(&p->lock);
+  setstate(p, RUNNABLE);
+  runq_push(p, 1);
+  release(&p->lock);
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void wakeup(void *chan)
 {
-  struct proc *p;
-  for (p = proc; p < &proc[NPROC]; p++)
+  struct sleepq *sq = &sleepq[SLEEPQHASH(chan)];
+  struct proc **pp, *p;
+
+  acquire(&sq->lock);
+  for (pp = &sq->head; (p = *pp) != 0;)
   {
-    if (p->state == RUNNING)
-    {
-      if (p->pid > 4)
-        // printf("RUNNING: update ticks for pid: %d\nretime %d\n", p->pid, p->retime);
-        p->rtime = p->rtime + 1;
-    }
+    if (p->chan == chan)
+      sleepq_wake(pp, p);
     else
-    {
-      if (p->state == SLEEPING)
-      {
-        if (p->pid > 4)
-          // printf("SLEEPING: update ticks for pid: %d\nstime %d\n", p->pid, p->stime);
-          p->stime = p->stime + 1;
-      }
-      else
-      {
-        if (p->state == RUNNABLE)
-        {
-          if (p->pid > 4)
-            // printf("RUNNABLE: update ticks for pid: %d\nretime %d\n", p->pid, p->retime);
-            p->retime = p->retime + 1;
-        }
-      }
-    }
+      pp = &p->sqnext;
   }
-  for (p = proc; p < &proc[NPROC]; p++)
+  release(&sq->lock);
+}
+
+// Wake up the process that has slept longest on chan,
+// for channels where only one waiter can make progress.
+// Must be called without any p->lock.
+void wakeup_one(void *chan)
+{
+  struct sleepq *sq = &sleepq[SLEEPQHASH(chan)];
+  struct proc **pp, **oldest = 0;
+
+  acquire(&sq->lock);
+  // sleep() pushes onto the head, so the last match is the oldest.
+  for (pp = &sq->head; *pp; pp = &(*pp)->sqnext)
   {
-    if (p != myproc())
-    {
-      acquire(&p->lock);
-      if (p->state == SLEEPING && p->chan == chan)
-      {
-        p->state = RUNNABLE;
-        p->accumulator = getMinAccumulator();
-      }
-      release(&p->lock);
-    }
+    if ((*pp)->chan == chan)
+      oldest = pp;
   }
+  if (oldest)
+    sleepq_wake(oldest, *oldest);
+  release(&sq->lock);
 }
 
 // Kill the process with the given pid.
@@ -785,7 +1471,9 @@ void wakeup(void *chan)
 // to user space (see usertrap() in trap.c).
 int kill(int pid)
 {
-  struct proc *p;
+  struct proc *p, **pp;
+  struct sleepq *sq;
+  void *chan;
 
   for (p = proc; p < &proc[NPROC]; p++)
   {
@@ -793,10 +1481,21 @@ int kill(int pid)
     if (p->pid == pid)
     {
       p->killed = 1;
-      if (p->state == SLEEPING)
+      // Wake process from sleep(). The sleep queue lock
+      // comes before p->lock, so let go of p->lock and
+      // check again that p is still asleep on chan.
+      while (p->state == SLEEPING)
       {
-        // Wake process from sleep().
-        p->state = RUNNABLE;
+        chan = p->chan;
+        release(&p->lock);
+        sq = &sleepq[SLEEPQHASH(chan)];
+        acquire(&sq->lock);
+        for (pp = &sq->head; *pp && *pp != p; pp = &(*pp)->sqnext)
+          ;
+        if (*pp)
+          sleepq_wake(pp, p);
+        release(&sq->lock);
+        acquire(&p->lock);
       }
       release(&p->lock);
       return 0;
@@ -870,6 +1569,7 @@ void procdump(void)
       [RUNNING] "run   ",
       [ZOMBIE] "zombie"};
   struct proc *p;
+  struct cpu *c;
   char *state;
 
   printf("\n");
@@ -882,6 +1582,14 @@ void procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    if (p->pagetable && p->state != ZOMBIE)
+      printf(" megapages %d", uvmmegapages(p->pagetable));
     printf("\n");
   }
+  for (c = cpus; c < &cpus[NCPU]; c++)
+  {
+    if (c->idletime)
+      printf("cpu %d idle %d ms\n", (int)(c - cpus), (int)(c->idletime * NS_PER_TIME / 1000000));
+  }
+  swapdump();
 }
@@ -18,12 +18,33 @@ struct context {
   uint64 s11;
 };
 
+#define NPRIO 10  // ps_priority levels, 1..NPRIO
+
+// Per-CPU queue of RUNNABLE processes, linked through p->rqnext.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;          // Oldest queued process
+  struct proc *tail;          // Newest queued process
+  int n;                      // Number of queued processes
+  struct proc *prio[NPRIO];   // Priority levels, each by accumulator
+  struct proc *priotail[NPRIO];
+  uint prioready;             // Bitmap of non-empty priority levels
+  long long min_accumulator;  // Never decreases; given to woken procs
+  struct proc *root;          // CFS red-black tree, by vruntime
+  struct proc *leftmost;      // Smallest vruntime in the tree
+  uint64 min_vruntime;        // Never decreases; placement of woken procs
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct runq rq;             // Processes waiting to run on this cpu.
+  int idle;                   // In wfi, waiting for work? (see kick())
+  uint64 idletime;            // Time spent in wfi, in time CSR units.
+  uint64 asidgen;             // ASID generation the TLB was last flushed for.
 };
 
 extern struct cpu cpus[NCPU];
@@ -81,6 +102,19 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory whose pages are filled in on
+// first access: an exec()ed program segment, or an
+// mmap()ed file or anonymous region.
+struct vma {
+  uint64 start;      // page-aligned; unused if end == 0
+  uint64 end;        // page-aligned
+  int perm;          // PTE_R/W/X of its pages
+  int flags;         // MAP_SHARED or MAP_PRIVATE if mmap()ed, else 0
+  struct inode *ip;  // holds a reference; 0 if anonymous
+  uint off;          // file offset of start
+  uint filesz;       // bytes from the file; the rest is zero
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -91,18 +125,37 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue p goes back on
+  int policy;                  // Scheduling policy (SCHED_* in sched.h)
+
+  // chan's sleep queue lock must be held when using this:
+  struct proc *sqnext;         // Next process on the sleep queue
+
+  // the run queue lock must be held when using these:
+  struct proc *rqnext;         // Next process on the run queue
+  struct proc *rb_parent;      // CFS run queue tree links
+  struct proc *rb_left;
+  struct proc *rb_right;
+  int rb_red;                  // Tree node color
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // p->vmlock must be held when using these (see uvmpin()):
+  struct spinlock vmlock;
+  int vmpin;                   // Kernel code is using p's page table
+  int swapping;                // The page reclaimer is using it
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  uint64 asid;                 // ASID and its generation; 0 if none (see proc_satp)
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Demand-paged file regions
   char name[16];               // Process name (debugging)
   char exit_msg[32];           // Exit Message
 
@@ -112,7 +165,9 @@ struct proc {
 
   //TASK 6
   int cfs_priority;
-  int rtime;   // run time 
-  int stime;   // sleep time
-  int retime;  // runnable time
+  uint64 vruntime; // run time weighted by cfs_priority
+  uint64 rtime;   // run time, in time CSR units
+  uint64 stime;   // sleep time
+  uint64 retime;  // runnable time
+  uint64 tstamp;  // time CSR at the last change of state
 };
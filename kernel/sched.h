@@ -0,0 +1,5 @@
+// Scheduling policies, for the sched_policy system call.
+#define SCHED_GLOBAL   -1  // follow the system-wide policy
+#define SCHED_DEFAULT   0  // round robin
+#define SCHED_PRIORITY  1  // ps_priority accumulators
+#define SCHED_CFS       2  // completely fair, by vruntime
@@ -0,0 +1,145 @@
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+
+// Swap space, for user pages evicted by the page reclaimer
+// in vm.c when memory runs out.
+//
+// mkfs lays out the swap area right after the file system;
+// the super block says where. It's divided into slots of
+// one page each. A swapped-out page's PTE holds its slot
+// number (see PTE_SWAP), and a slot is free again once no
+// PTE refers to it: fork() can leave a parent's and a
+// child's PTEs referring to the same slot, and each reads
+// the page back into its own memory.
+//
+// Pages go to and from the disk in one request, through
+// buffers of swap's own, so they don't push file system
+// blocks out of the buffer cache.
+
+#define BPS (PGSIZE / BSIZE)    // blocks per slot
+#define NSLOT (SWAPSIZE / BPS)
+
+struct {
+  struct spinlock lock;
+  uint dev;
+  uint start;          // block number of slot 0
+  int nslot;           // number of slots on the disk
+  int next;            // where to start looking for a free slot
+  uchar ref[NSLOT];    // number of PTEs referring to each slot
+  int nfree;
+  uint64 nin;          // pages read in, ever
+  uint64 nout;         // pages written out, ever
+  struct sleeplock io; // protects buf
+  struct buf buf[BPS];
+} swap;
+
+void
+swapinit(int dev, struct superblock *sb)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.io, "swapio");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / BPS;
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+  swap.nfree = swap.nslot;
+}
+
+// Allocate a slot, with one reference.
+// Returns -1 if swap is full.
+int
+swapalloc(void)
+{
+  int i, slot = -1;
+
+  acquire(&swap.lock);
+  for(i = 0; i < swap.nslot && swap.nfree > 0; i++){
+    if(swap.ref[swap.next] == 0){
+      slot = swap.next;
+      swap.ref[slot] = 1;
+      swap.nfree--;
+      break;
+    }
+    swap.next = (swap.next + 1) % swap.nslot;
+  }
+  release(&swap.lock);
+  return slot;
+}
+
+// Add a reference to slot.
+void
+swapdup(int slot)
+{
+  acquire(&swap.lock);
+  if(swap.ref[slot] == 0 || swap.ref[slot] == 255)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot, freeing it if it was the last.
+void
+swapfree(int slot)
+{
+  acquire(&swap.lock);
+  if(slot < 0 || slot >= swap.nslot || swap.ref[slot] == 0)
+    panic("swapfree");
+  if(--swap.ref[slot] == 0)
+    swap.nfree++;
+  release(&swap.lock);
+}
+
+// Copy the page at pa to or from slot.
+static void
+swaprw(int slot, char *pa, int write)
+{
+  struct buf *b[BPS];
+  int i;
+
+  acquiresleep(&swap.io);
+  for(i = 0; i < BPS; i++){
+    b[i] = &swap.buf[i];
+    b[i]->dev = swap.dev;
+    b[i]->blockno = swap.start + slot*BPS + i;
+    if(write)
+      memmove(b[i]->data, pa + i*BSIZE, BSIZE);
+  }
+  virtio_disk_startv(b, BPS, write);
+  for(i = 0; i < BPS; i++){
+    virtio_disk_wait(b[i]);
+    if(!write)
+      memmove(pa + i*BSIZE, b[i]->data, BSIZE);
+  }
+  releasesleep(&swap.io);
+}
+
+// Write the page at pa out to slot.
+void
+swapwrite(int slot, char *pa)
+{
+  swaprw(slot, pa, 1);
+  __sync_fetch_and_add(&swap.nout, 1);
+}
+
+// Read slot's page into the page at pa.
+void
+swapread(int slot, char *pa)
+{
+  swaprw(slot, pa, 0);
+  __sync_fetch_and_add(&swap.nin, 1);
+}
+
+// Print swap usage and traffic, for procdump().
+void
+swapdump(void)
+{
+  printf("swap %d/%d pages used, %d in, %d out\n",
+         swap.nslot - swap.nfree, swap.nslot, (int)swap.nin, (int)swap.nout);
+}
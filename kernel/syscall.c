@@ -102,9 +102,13 @@ extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
 extern uint64 sys_memsize(void);
+extern uint64 sys_nmegapages(void);
 extern uint64 sys_set_ps_priority(void);
 extern uint64 sys_set_cfs_priority(void);
 extern uint64 sys_get_cfs_stats(void);
+extern uint64 sys_sched_policy(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -134,6 +138,10 @@ static uint64 (*syscalls[])(void) = {
 [SYS_set_ps_priority]   sys_set_ps_priority,
 [SYS_set_cfs_priority]   sys_set_cfs_priority,
 [SYS_get_cfs_stats]   sys_get_cfs_stats,
+[SYS_sched_policy]   sys_sched_policy,
+[SYS_mmap]   sys_mmap,
+[SYS_munmap]   sys_munmap,
+[SYS_nmegapages]   sys_nmegapages,
 };
 
 void
@@ -23,4 +23,8 @@
 #define SYS_memsize  22
 #define SYS_set_ps_priority  23
 #define SYS_set_cfs_priority  24
-#define SYS_get_cfs_stats  25
\ No newline at end of file
+#define SYS_get_cfs_stats  25
+#define SYS_sched_policy  26
+#define SYS_mmap  27
+#define SYS_munmap  28
+#define SYS_nmegapages  29
\ No newline at end of file
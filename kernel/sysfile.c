@@ -15,6 +15,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -503,3 +504,57 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Map a file, or anonymous memory, into the process.
+// The address argument is only a hint, and ignored.
+uint64
+sys_mmap(void)
+{
+  int len, prot, flags, off, perm = 0;
+  struct file *f;
+  struct inode *ip = 0;
+
+  argint(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if(len <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if(((flags & MAP_SHARED) == 0) == ((flags & MAP_PRIVATE) == 0))
+    return -1;
+
+  if(prot & PROT_READ)
+    perm |= PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_R | PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(perm == 0)
+    return -1;
+
+  if((flags & MAP_ANONYMOUS) == 0){
+    if(argfd(4, 0, &f) < 0 || f->type != FD_INODE || !f->readable)
+      return -1;
+    // stores to a shared mapping would have to reach the
+    // file at once for read()s and other mappings to see
+    // them, and nothing makes them; so there are none.
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE))
+      return -1;
+    ip = f->ip;
+  }
+
+  return vmamap(myproc(), len, perm, flags & (MAP_SHARED|MAP_PRIVATE), ip, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  if(len <= 0)
+    return -1;
+  return vmaunmap(myproc(), addr, len);
+}
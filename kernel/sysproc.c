@@ -104,6 +104,21 @@ sys_memsize(void)
   return sz;
 }
 
+// return the number of megapages mapping the running
+// process' memory.
+uint64
+sys_nmegapages(void)
+{
+  struct proc *p = myproc();
+  int n;
+
+  // keep the page reclaimer from demoting any meanwhile.
+  uvmpin(p);
+  n = uvmmegapages(p->pagetable);
+  uvmunpin(p);
+  return n;
+}
+
 // used by a process to change its own priority.
 uint64
 sys_set_ps_priority(void)
@@ -129,16 +144,18 @@ sys_get_cfs_stats(void)
 {
   int pid;
   uint64 addr;
-  char ans[4] = {0, 0, 0, 0};
   argint(0, &pid);
   argaddr(1, &addr);
-  struct proc *p = getProc(pid);
-  if (p == 0)
-    return -1;
-  ans[0] = p->cfs_priority;
-  ans[1] = p->rtime;
-  ans[2] = p->stime;
-  ans[3] = p->retime;
-  copyout(p->pagetable, addr, ans, 4);
-  return 0;
+  return get_cfs_stats(pid, addr);
+}
+
+// switches the scheduling policy of a process,
+// or of the whole system when pid is 0.
+uint64
+sys_sched_policy(void)
+{
+  int pid, policy;
+  argint(0, &pid);
+  argint(1, &policy);
+  return sched_policy(pid, policy);
 }
@@ -8,7 +8,6 @@
 
 struct spinlock tickslock;
 uint ticks;
-extern void update_ticks(void);
 
 extern char trampoline[], uservec[], userret[];
 
@@ -17,6 +16,8 @@ void kernelvec();
 
 extern int devintr();
 
+extern uint64 timer_scratch[NCPU][7]; // start.c
+
 void trapinit(void)
 {
   initlock(&tickslock, "time");
@@ -48,7 +49,17 @@ void usertrap(void)
   // save user program counter.
   p->trapframe->epc = r_sepc();
 
-  if (r_scause() == 8)
+  // for a page fault, the kind of access that faulted.
+  uint64 scause = r_scause();
+  int access = 0;
+  if (scause == 12)
+    access = PTE_X;
+  else if (scause == 13)
+    access = PTE_R;
+  else if (scause == 15)
+    access = PTE_W;
+
+  if (scause == 8)
   {
     // system call
 
@@ -65,6 +76,12 @@ void usertrap(void)
 
     syscall();
   }
+  else if (access != 0 && uvmfault(p, r_stval(), access) == 0)
+  {
+    // access to a page not yet read in by exec() or
+    // allocated by sbrk(), or a store to a copy-on-write
+    // page; now it's there.
+  }
   else if ((which_dev = devintr()) != 0)
   {
     // ok
@@ -125,7 +142,7 @@ void usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = proc_satp(p);
 
   // jump to userret in trampoline.S at the top of memory, which
   // switches to the user page table, restores user registers,
@@ -219,19 +236,25 @@ int devintr()
   }
   else if (scause == 0x8000000000000001L)
   {
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
+
+    // acknowledge the software interrupt by clearing
+    // the SSIP bit in sip.
+    w_sip(r_sip() & ~2);
+
+    // an IPI only needs to wake this hart from wfi.
+    // read and clear the timer's flag in one go, so a timer
+    // interrupt that sets it in between isn't lost.
+    uint64 *scratch = timer_scratch[cpuid()];
+    if (__atomic_exchange_n(&scratch[5], 0, __ATOMIC_SEQ_CST) == 0)
+      return 1;
 
     if (cpuid() == 0)
     {
       clockintr();
-      update_ticks();
     }
 
-    // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
-
     return 2;
   }
   else
@@ -47,7 +47,10 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 64
+
+// most blocks in one request; it takes NSEG+2 descriptors.
+#define NSEG 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -46,10 +46,13 @@ static struct disk {
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
     char status;
+    char ahead;    // from virtio_disk_readahead()?
   } info[NUM];
 
+  // the struct buf whose data each descriptor points to.
+  struct buf *bufs[NUM];
+
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
@@ -118,14 +121,11 @@ virtio_disk_init(void)
     panic("virtio disk max queue too short");
 
   // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
+  disk.desc = kalloc_zeroed();
+  disk.avail = kalloc_zeroed();
+  disk.used = kalloc_zeroed();
   if(!disk.desc || !disk.avail || !disk.used)
     panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
 
   // set queue size.
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
@@ -178,7 +178,6 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
 // free a chain of descriptors.
@@ -194,14 +193,16 @@ free_chain(int i)
     else
       break;
   }
+  // requests differ in length, so any of the waiting
+  // ones might fit now.
+  wakeup(&disk.free[0]);
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +213,19 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// the spec's Section 5.2 says that legacy block operations use
+// three or more descriptors: one for type/reserved/sector, one
+// per data buffer, and one for a 1-byte status result.
+// fill in idx[], n+2 descriptors from alloc_descs(), to transfer
+// the n bufs in b[], which hold consecutive blocks, and tell the
+// device. caller must hold disk.vdisk_lock.
+static void
+submit(int *idx, struct buf **b, int n, int write, int ahead)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+  uint64 sector = b[0]->blockno * (BSIZE / 512);
+  int i, d;
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,24 +242,29 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 0; i < n; i++){
+    d = idx[1+i];
+    disk.desc[d].addr = (uint64) b[i]->data;
+    disk.desc[d].len = BSIZE;
+    if(write)
+      disk.desc[d].flags = 0; // device reads b->data
+    else
+      disk.desc[d].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[d].flags |= VRING_DESC_F_NEXT;
+    disk.desc[d].next = idx[2+i];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+    // record struct buf for virtio_disk_intr().
+    b[i]->disk = 1;
+    disk.bufs[d] = b[i];
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  d = idx[n+1];
+  disk.info[idx[0]].status = 0xff; // device writes 0 on success
+  disk.info[idx[0]].ahead = ahead;
+  disk.desc[d].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[d].len = 1;
+  disk.desc[d].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[d].next = 0;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -279,15 +277,84 @@ virtio_disk_rw(struct buf *b, int write)
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+// Start reading or writing the n bufs in b[], which must hold
+// consecutive blocks, in requests of up to NSEG blocks, and
+// return without waiting for the disk, though perhaps after
+// waiting for room in the queue. virtio_disk_intr() marks each
+// buf valid when the disk is done with it; virtio_disk_wait()
+// waits for that.
+void
+virtio_disk_startv(struct buf **b, int n, int write)
+{
+  int idx[NSEG+2];
+  int m;
+
+  for(int i = 1; i < n; i++)
+    if(b[i]->blockno != b[0]->blockno + i)
+      panic("virtio_disk_startv");
+
+  acquire(&disk.vdisk_lock);
+
+  for(; n > 0; n -= m, b += m){
+    m = n < NSEG ? n : NSEG;
+
+    // allocate the descriptors.
+    while(1){
+      if(alloc_descs(idx, m+2) == 0) {
+        break;
+      }
+      sleep(&disk.free[0], &disk.vdisk_lock);
+    }
+
+    submit(idx, b, m, write, 0);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  release(&disk.vdisk_lock);
+}
+
+// Start reading or writing b.
+void
+virtio_disk_start(struct buf *b, int write)
+{
+  virtio_disk_startv(&b, 1, write);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_start(b, write);
+  virtio_disk_wait(b);
+}
+
+// Like virtio_disk_start(b, 0), but the caller bpin()s b for
+// the read, and virtio_disk_intr() bunpin()s b when the read
+// is done. Returns -1, having started nothing, if the queue
+// is full.
+int
+virtio_disk_readahead(struct buf *b)
+{
+  int idx[3];
+
+  acquire(&disk.vdisk_lock);
+  if(alloc_descs(idx, 3) < 0){
+    release(&disk.vdisk_lock);
+    return -1;
+  }
+  submit(idx, &b, 1, 0, 1);
+  release(&disk.vdisk_lock);
+  return 0;
+}
 
+// Wait for virtio_disk_intr() to say the disk is done with
+// b, if it's reading or writing it.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  while(b->disk == 1)
+    sleep(b, &disk.vdisk_lock);
   release(&disk.vdisk_lock);
 }
 
@@ -316,9 +383,16 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    for(int i = disk.desc[id].next; disk.bufs[i]; i = disk.desc[i].next){
+      struct buf *b = disk.bufs[i];
+      disk.bufs[i] = 0;
+      b->valid = 1;  // b->data matches the disk
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+      if(disk.info[id].ahead)
+        bunpin(b);
+    }
+    free_chain(id);
 
     disk.used_idx += 1;
   }
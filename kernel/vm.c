@@ -3,8 +3,13 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
 #include "defs.h"
 #include "fs.h"
+#include "file.h"
+#include "mman.h"
 
 /*
  * the kernel's page table.
@@ -15,14 +20,18 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+extern struct proc proc[NPROC];
+
+static char *uvmkalloc(int);
+static int uvmmap(pagetable_t, uint64, char *, int);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -30,6 +39,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for inter-processor interrupts
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -70,9 +82,38 @@ kvminithart()
   sfence_vma();
 }
 
+// Return the address of the PTE at level *level in page
+// table pagetable that corresponds to virtual address va,
+// or of a leaf PTE above that level, i.e. a megapage, and
+// set *level to the level of the PTE returned.
+// If alloc!=0, create any required page-table pages.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
+{
+  if(va >= MAXVA)
+    panic("walk");
+
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
+    if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        *level = l;
+        return pte;
+      }
+      pagetable = (pagetable_t)PTE2PA(*pte);
+    } else {
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
+        return 0;
+      *pte = PA2PTE(pagetable) | PTE_V;
+    }
+  }
+  return &pagetable[PX(*level, va)];
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// create any required page-table pages. If va lies in a
+// megapage, this is the megapage's level-1 leaf PTE.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -82,24 +123,14 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+// A leaf PTE at level 1 maps a 2 MiB megapage, and
+// bits 12..20 are part of the offset.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
-  if(va >= MAXVA)
-    panic("walk");
+  int level = 0;
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
-    if(*pte & PTE_V) {
-      pagetable = (pagetable_t)PTE2PA(*pte);
-    } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
-        return 0;
-      memset(pagetable, 0, PGSIZE);
-      *pte = PA2PTE(pagetable) | PTE_V;
-    }
-  }
-  return &pagetable[PX(0, va)];
+  return walklevel(pagetable, va, alloc, &level);
 }
 
 // Look up a virtual address, return the physical address,
@@ -110,11 +141,12 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
@@ -122,6 +154,8 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(level == 1)
+    pa += PGROUNDDOWN(va) & (MEGAPGSIZE - 1);
   return pa;
 }
 
@@ -137,13 +171,16 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Wherever va and pa are both 2 MiB aligned
+// and at least 2 MiB remain, maps a megapage with a single
+// level-1 PTE. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
+  int level;
 
   if(size == 0)
     panic("mappages: size");
@@ -151,36 +188,154 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && last - a >= MEGAPGSIZE - PGSIZE){
+      level = 1;
+      sz = MEGAPGSIZE;
+    } else {
+      level = 0;
+      sz = PGSIZE;
+    }
+    if((pte = walklevel(pagetable, a, 1, &level)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(a + sz - PGSIZE == last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+    pa += sz;
   }
   return 0;
 }
 
+// A valid PTE of pagetable changed. If it belongs to the
+// current process, drop its ASID so it gets a fresh one on
+// the way back to user space, and no CPU's TLB can still
+// hold the old translation. No other user page table is in
+// use by any CPU.
+static void
+uvmflush(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    p->asid = 0;
+}
+
+// Turn the user megapage mapped by level-1 PTE pte into
+// 512 page mappings of the same memory, in page-table
+// page pt, so that parts of it can be unmapped or shared.
+static void
+uvmdemote(pte_t *pte, pagetable_t pt)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+
+  ksplit((void*)pa, MEGAPGORDER);
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+}
+
+// Replace the 512 pages mapped by the page-table page
+// under level-1 PTE pte with one megapage holding a copy
+// of them, if they're all there, private and writable,
+// and 2 MiB of contiguous memory is free. A copy-on-write
+// page nothing else shares any more counts as writable.
+static void
+uvmpromote(pte_t *pte)
+{
+  pagetable_t pt = (pagetable_t)PTE2PA(*pte);
+  char *mem;
+  int i;
+
+  for(i = 0; i < 512; i++){
+    if((pt[i] & (PTE_V|PTE_R|PTE_X|PTE_U)) != (PTE_V|PTE_R|PTE_U) ||
+       (pt[i] & (PTE_W|PTE_COW)) == 0)
+      return;
+    if(krefs((void*)PTE2PA(pt[i])) != 1)
+      return;
+  }
+  if((mem = kalloc_order(MEGAPGORDER)) == 0)
+    return;
+  for(i = 0; i < 512; i++){
+    memmove(mem + i*PGSIZE, (char*)PTE2PA(pt[i]), PGSIZE);
+    kfree((void*)PTE2PA(pt[i]));
+  }
+  *pte = PA2PTE(mem) | PTE_V | PTE_R | PTE_W | PTE_U;
+  kfree(pt);
+}
+
+// Number of user megapages in pagetable.
+int
+uvmmegapages(pagetable_t pagetable)
+{
+  pagetable_t pt;
+  int i, j, n = 0;
+
+  for(i = 0; i < 512; i++){
+    if((pagetable[i] & PTE_V) == 0 || PTE_LEAF(pagetable[i]))
+      continue;
+    pt = (pagetable_t)PTE2PA(pagetable[i]);
+    for(j = 0; j < 512; j++)
+      if((pt[j] & (PTE_V|PTE_U)) == (PTE_V|PTE_U) && PTE_LEAF(pt[j]))
+        n++;
+  }
+  return n;
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never faulted in are
+// skipped, and swapped-out ones' slots freed. A megapage
+// only partly in the range is first demoted to pages.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end = va + npages*PGSIZE, pa;
+  pagetable_t pt;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  for(a = va; a < end; a += PGSIZE){
+    level = 0;
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0){
+      // no page-table page, so nothing mapped up to the next one.
+      a = (a | (MEGAPGSIZE - 1)) + 1 - PGSIZE;
+      continue;
+    }
+    if(level == 1){
+      pa = PTE2PA(*pte);
+      if(a % MEGAPGSIZE == 0 && end - a >= MEGAPGSIZE){
+        if(do_free)
+          kfree_order((void*)pa, MEGAPGORDER);
+        *pte = 0;
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      if((pt = kalloc_zeroed()) != 0){
+        uvmdemote(pte, pt);
+      } else if(do_free){
+        // out of memory: the page at a is going anyway,
+        // so it can be the new page-table page.
+        pt = (pagetable_t)(pa + a % MEGAPGSIZE);
+        uvmdemote(pte, pt);
+        pt[PX(0, a)] = 0;
+      } else {
+        panic("uvmunmap: demote");
+      }
+      pte = walk(pagetable, a, 0);
+    }
+    if(*pte & PTE_SWAP){
+      swapfree(PTE2SLOT(*pte));
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -189,6 +344,7 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     }
     *pte = 0;
   }
+  uvmflush(pagetable);
 }
 
 // create an empty user page table.
@@ -197,10 +353,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -214,14 +369,14 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
 
 // Allocate PTEs and physical memory to grow process from oldsz to
-// newsz, which need not be page aligned.  Returns new size or 0 on error.
+// newsz, which need not be page aligned, swapping other pages out
+// if memory is short.  Returns new size or 0 on error.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 {
@@ -233,13 +388,12 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = uvmkalloc(1);
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
+    if(uvmmap(pagetable, a, mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
@@ -296,42 +450,892 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Map the pages of [start, end) in old into new as well.
+// If cow is set, writable pages become read-only and
+// copy-on-write in both, and uvmcow() copies them on the
+// first store; otherwise they stay shared and writable.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
-int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+static int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
 {
-  pte_t *pte;
+  pte_t *pte, *npte;
+  pagetable_t pt;
   uint64 pa, i;
   uint flags;
-  char *mem;
+  int level;
+
+  // old's PTEs lose PTE_W or get demoted.
+  uvmflush(old);
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = start; i < end; i += PGSIZE){
+    level = 0;
+    if((pte = walklevel(old, i, 0, &level)) == 0){
+      // skip a range that was never faulted in.
+      i = (i | (MEGAPGSIZE - 1)) + 1 - PGSIZE;
+      continue;
+    }
+    if(level == 1){
+      // pages are shared and copied one at a time;
+      // dofault() promotes the stretch again once
+      // the parent's pages are all its own.
+      if((pt = kalloc_zeroed()) == 0)
+        goto err;
+      uvmdemote(pte, pt);
+      pte = walk(old, i, 0);
+    }
+    if(*pte & PTE_SWAP){
+      // both refer to the slot; each reads in its own copy.
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      swapdup(PTE2SLOT(*pte));
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
+    kdup((void*)pa);
+  }
+  return 0;
+
+ err:
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
+  return -1;
+}
+
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// Copies only the page table: writable pages
+// become copy-on-write; see uvmshare().
+// returns 0 on success, -1 on failure.
+// frees any allocated pages on failure.
+int
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Resolve a store to the copy-on-write page at va:
+// give the page table its own writable copy, or just
+// make the page writable if nothing else shares it.
+// returns 0 on success, -1 if va isn't a copy-on-write
+// page or there's no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  uvmflush(pagetable);
+
+  if(krefs((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Paging to swap.
+//
+// When memory runs out, uvmreclaim() evicts user pages
+// that haven't been used lately to swap (see swap.c), and
+// a later fault reads them back in. It looks at the pages
+// of every process in turn, like a clock hand going round:
+// a page that has been accessed (PTE_A) since the hand last
+// passed loses its PTE_A and gets a second chance.
+// Shared pages, those of MAP_SHARED regions and those with
+// more than one reference, stay put. A cold megapage is
+// demoted, by evicting its first page and using that
+// page's memory as the new page-table page.
+//
+// The reclaimer edits other processes' page tables, so a
+// process's own kernel code pins its page table with
+// uvmpin() while it looks at or changes its PTEs or vmas,
+// and the reclaimer only takes on a process that isn't
+// pinned, or the one it's running in. A process can still
+// run in user space while the reclaimer works on it, so a
+// PTE is only cleared while the process isn't running, and
+// takes its ASID with it; the process faults on the page
+// next time, and the fault waits in uvmpin().
+
+#define SWAPBATCH 8     // pages evicted per uvmreclaim()
+#define SWAPSCAN  1024  // pages looked at per process per turn
+
+// the reclaimer's clock hand.
+struct {
+  struct spinlock lock;
+  int i;       // index in proc[] of the process it's at
+  uint64 va;   // next address to look at there
+} hand;
+
+void
+uvminit(void)
+{
+  initlock(&hand.lock, "hand");
+}
+
+// Keep the page reclaimer away from p's page table and
+// vmas until uvmunpin(). Sleeps while it's at work on them.
+// Pins nest.
+void
+uvmpin(struct proc *p)
+{
+  acquire(&p->vmlock);
+  while(p->swapping)
+    sleep(&p->swapping, &p->vmlock);
+  p->vmpin++;
+  release(&p->vmlock);
+}
+
+void
+uvmunpin(struct proc *p)
+{
+  acquire(&p->vmlock);
+  if(p->vmpin < 1)
+    panic("uvmunpin");
+  p->vmpin--;
+  release(&p->vmlock);
+}
+
+// Take p's page table for the reclaimer, if nothing else
+// is using it. returns 1 if it did, 0 if not.
+static int
+uvmclaim(struct proc *p)
+{
+  int ok;
+
+  acquire(&p->vmlock);
+  ok = (p->vmpin == 0 || p == myproc()) && !p->swapping;
+  if(ok)
+    p->swapping = 1;
+  release(&p->vmlock);
+  if(!ok)
+    return 0;
+
+  acquire(&p->lock);
+  ok = (p->state == SLEEPING || p->state == RUNNABLE || p->state == RUNNING) &&
+       p->pagetable != 0;
+  release(&p->lock);
+  if(!ok){
+    acquire(&p->vmlock);
+    p->swapping = 0;
+    release(&p->vmlock);
+  }
+  return ok;
+}
+
+static void
+uvmunclaim(struct proc *p)
+{
+  acquire(&p->vmlock);
+  p->swapping = 0;
+  release(&p->vmlock);
+  wakeup(&p->swapping);
+}
+
+// The lowest address at or above va that might hold an
+// evictable page of p: below p->sz, or in a private vma.
+// MAXVA if there's none.
+static uint64
+evictnext(struct proc *p, uint64 va)
+{
+  struct vma *v;
+  uint64 next = MAXVA;
+
+  if(va < p->sz)
+    return va;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || (v->flags & MAP_SHARED) || v->end <= va)
+      continue;
+    if(v->start <= va)
+      return va;
+    if(v->start < next)
+      next = v->start;
+  }
+  return next;
+}
+
+// Clear p's PTE pte, of the page at va, leaving a swap
+// entry for slot in its place, unless p is running in user
+// space. returns the physical address of the page, or 0.
+static uint64
+evictpte(struct proc *p, pte_t *pte, int slot)
+{
+  uint64 pa = 0;
+
+  acquire(&p->lock);
+  if(p->state != RUNNING || p == myproc()){
+    pa = PTE2PA(*pte);
+    *pte = SLOT2PTE(slot) | (PTE_FLAGS(*pte) & (PTE_R|PTE_W|PTE_X|PTE_U|PTE_COW)) | PTE_SWAP;
+    p->asid = 0;
+  }
+  release(&p->lock);
+  return pa;
+}
+
+// Evict cold pages of p, which the caller has claimed, to
+// swap, looking at its pages from *va up. Stops after
+// SWAPBATCH pages or SWAPSCAN looks, and sets *va to where
+// to carry on; MAXVA if it got to the end.
+// returns the number of pages freed, or -1 if it can't
+// evict any more of p's pages for now.
+static int
+uvmevict(struct proc *p, uint64 *va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  uint64 a, pa;
+  int i, level, slot, n = 0, aged = 0;
+
+  for(i = 0; i < SWAPSCAN && n < SWAPBATCH; i++){
+    if((a = evictnext(p, *va)) >= MAXVA)
+      break;
+    *va = a + PGSIZE;
+    level = 0;
+    if((pte = walklevel(p->pagetable, a, 0, &level)) == 0){
+      // no page-table page, so nothing mapped up to the next one.
+      *va = (a | (MEGAPGSIZE - 1)) + 1;
+      continue;
+    }
+    if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      aged = 1;
+      continue;
+    }
+    pa = PTE2PA(*pte);
+    if(level == 0 && krefs((void*)pa) != 1)
+      continue;
+
+    if((slot = swapalloc()) < 0){
+      n = n ? n : -1;
+      break;
+    }
+    if(level == 1)
+      a -= a % MEGAPGSIZE;
+    if(evictpte(p, pte, slot) == 0){
+      swapfree(slot);
+      n = n ? n : -1;
+      break;
+    }
+    swapwrite(slot, (char*)pa);
+    if(level == 1){
+      // the first page's memory becomes the page-table
+      // page for the rest. *pte stays the swap entry until
+      // pt is complete: as a valid leaf, it would map pt
+      // into user space.
+      pt = (pagetable_t)pa;
+      ksplit((void*)pa, MEGAPGORDER);
+      for(int j = 1; j < 512; j++)
+        pt[j] = PA2PTE(pa + j*PGSIZE) | (PTE_FLAGS(*pte) & (PTE_R|PTE_W|PTE_X|PTE_U)) | PTE_V;
+      pt[0] = *pte;
+      acquire(&p->lock);
+      *pte = PA2PTE(pt) | PTE_V;
+      p->asid = 0;
+      release(&p->lock);
+      *va = a + PGSIZE;
+    } else {
+      kfree((void*)pa);
+      n++;
     }
   }
+  if(*va >= MAXVA || evictnext(p, *va) >= MAXVA)
+    *va = MAXVA;
+
+  if(aged){
+    // make the TLB forget PTE_A, so it's set again on use.
+    acquire(&p->lock);
+    p->asid = 0;
+    release(&p->lock);
+  }
+  return n;
+}
+
+// Free some memory by evicting cold user pages to swap.
+// Called when kalloc() fails, from a context that may sleep
+// and that doesn't hold the physical address of any user
+// page of the current process.
+// returns the number of pages freed.
+int
+uvmreclaim(void)
+{
+  struct proc *p;
+  uint64 va;
+  int i, n = 0, turns = 0;
+
+  // the hand goes round at most twice: once to clear
+  // PTE_A bits, once to find those still clear.
+  while(n <= 0 && turns < 2*NPROC){
+    acquire(&hand.lock);
+    i = hand.i;
+    va = hand.va;
+    release(&hand.lock);
+
+    p = &proc[i];
+    if(uvmclaim(p)){
+      n = uvmevict(p, &va);
+      uvmunclaim(p);
+      if(n < 0)
+        va = MAXVA;
+    } else {
+      va = MAXVA;
+    }
+
+    acquire(&hand.lock);
+    if(hand.i == i){
+      if(va >= MAXVA){
+        hand.i = (i + 1) % NPROC;
+        hand.va = 0;
+      } else {
+        hand.va = va;
+      }
+    }
+    release(&hand.lock);
+    if(va >= MAXVA)
+      turns++;
+  }
+  return n > 0 ? n : 0;
+}
+
+// kalloc() a page of user memory, or kalloc_zeroed() if
+// zero is set, making room if need be by evicting other
+// pages, once kalloc() has shrunk the buffer cache all it
+// can; see uvmreclaim() for when that's allowed.
+static char *
+uvmkalloc(int zero)
+{
+  char *mem;
+
+  do {
+    if((mem = zero ? kalloc_zeroed() : kalloc()) != 0)
+      return mem;
+  } while(uvmreclaim() > 0);
+  return 0;
+}
+
+// Map the page of user memory mem at va, making room for any
+// page-table pages that takes the way uvmkalloc() does.
+static int
+uvmmap(pagetable_t pagetable, uint64 va, char *mem, int perm)
+{
+  while(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0)
+    if(uvmreclaim() == 0)
+      return -1;
+  return 0;
+}
+
+// Read the page at va in from v's file, or zero it if
+// v is anonymous or va is past the file's part of v, and
+// map it.
+// A read-only page is shared with every other process
+// mapping the same page of the file, through itext().
+// Sleeps, so the caller must not hold any spinlocks, nor
+// any inode lock but v's: see vmaprefault().
+// returns 0 on success, -1 on failure.
+static int
+vmafill(pagetable_t pagetable, struct vma *v, uint64 va)
+{
+  uint64 off = va - v->start;
+  uint n = 0;
+  int locked, r = 0;
+  char *mem;
+
+  if(off < v->filesz)
+    n = v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE;
+
+  if(v->ip == 0 || n == 0){
+    mem = uvmkalloc(1);
+  } else {
+    // copyout() from a readi() of this very file
+    // faults with the inode already locked.
+    locked = holdingsleep(&v->ip->lock);
+    if(!locked)
+      ilock(v->ip);
+    if((v->perm & PTE_W) == 0 && (v->off + off) % PGSIZE == 0){
+      mem = (char*)itext(v->ip, v->off + off, n);
+    } else if((mem = uvmkalloc(n < PGSIZE)) != 0 && n > 0){
+      r = readi(v->ip, 0, (uint64)mem, v->off + off, n);
+      if(r != n){
+        kfree(mem);
+        mem = 0;
+      }
+    }
+    if(!locked)
+      iunlock(v->ip);
+  }
+
+  if(mem == 0)
+    return -1;
+  if(uvmmap(pagetable, va, mem, v->perm|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Read the page at va, which uvmreclaim() evicted to swap,
+// back in. Sleeps, so the caller must not hold any spinlocks.
+// returns 0 on success, -1 if there's no memory for it.
+static int
+uvmswapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 flags;
+  char *mem;
+  int slot;
+
+  if((mem = uvmkalloc(0)) == 0)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  slot = PTE2SLOT(*pte);
+  swapread(slot, mem);
+  flags = PTE_FLAGS(*pte) & (PTE_R|PTE_W|PTE_X|PTE_U|PTE_COW);
+  if(flags & PTE_COW){
+    // the page is no longer shared with anyone.
+    flags = (flags & ~PTE_COW) | PTE_W;
+  }
+  *pte = PA2PTE(mem) | flags | PTE_V;
+  swapfree(slot);
+  return 0;
+}
+
+// If the aligned 2 MiB stretch of p's heap holding va is
+// all there and private, make it a megapage. Called when a
+// fault has filled in a page of it, or, after fork() demoted
+// it, given p its own copy of one.
+static void
+uvmheappromote(struct proc *p, uint64 va)
+{
+  uint64 base = va - va % MEGAPGSIZE;
+  struct vma *v;
+  int level;
+
+  if(base + MEGAPGSIZE > p->sz)
+    return;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0 && v->start < base + MEGAPGSIZE && v->end > base)
+      return;
+  level = 1;
+  uvmpromote(walklevel(p->pagetable, base, 0, &level));
+  uvmflush(p->pagetable);
+}
+
+// uvmfault(), with p pinned.
+static int
+dofault(struct proc *p, uint64 va, int access)
+{
+  pte_t *pte;
+  struct vma *v;
+  char *mem;
+
+ again:
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_SWAP)){
+    if(uvmswapin(p->pagetable, va) != 0)
+      return -1;
+    goto again;
+  }
+  if(pte && (*pte & PTE_V)){
+    if(access == PTE_W && (*pte & PTE_COW)){
+      if(uvmcow(p->pagetable, va) == 0){
+        uvmheappromote(p, va);
+        return 0;
+      }
+      if(uvmreclaim() > 0)
+        goto again;
+      return -1;
+    }
+    if((*pte & PTE_U) && (*pte & access)){
+      // the TLB held on to an invalid translation from
+      // before the page was faulted in, or the hardware
+      // wants the accessed and dirty bits set by software.
+      *pte |= PTE_A | (access == PTE_W ? PTE_D : 0);
+      uvmflush(p->pagetable);
+      return 0;
+    }
+    return -1;
+  }
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end != 0 && va >= v->start && va < v->end){
+      if((v->perm & access) == 0)
+        return -1;
+      return vmafill(p->pagetable, v, va);
+    }
+  }
+  if(va >= p->sz)
+    return -1;
+  if((mem = uvmkalloc(1)) == 0)
+    return -1;
+  if(uvmmap(p->pagetable, va, mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+
+  // that may have filled in the last page of an aligned
+  // 2 MiB stretch of heap.
+  uvmheappromote(p, va);
+  return 0;
+}
+
+// Handle a page fault by process p at va. A page of one of
+// p's vmas is read in from its file; any other page below
+// p->sz that sbrk() added but nothing has touched yet is
+// filled in with zeroes; a store to a copy-on-write page
+// copies it; an evicted page comes back from swap.
+// access is the PTE permission the faulting access
+// needed: PTE_R, PTE_W or PTE_X.
+// returns 0 if the access can be retried, -1 if it's a
+// genuine fault.
+int
+uvmfault(struct proc *p, uint64 va, int access)
+{
+  int r;
+
+  if(va >= MAXVA)
+    return -1;
+  uvmpin(p);
+  r = dofault(p, PGROUNDDOWN(va), access);
+  uvmunpin(p);
+  return r;
+}
+
+// Give fork()ed child np the vmas of its parent p, and
+// the pages of p's mmap()ed regions: those of MAP_SHARED
+// ones stay shared, those of MAP_PRIVATE ones become
+// copy-on-write. (The rest of p's memory is below p->sz
+// and copied by uvmcopy().)
+// returns 0 on success, -1 on failure.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->end != 0 && v->flags != 0 &&
+       uvmshare(p->pagetable, np->pagetable, v->start, v->end,
+                (v->flags & MAP_SHARED) == 0) != 0)
+      goto err;
+  }
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(np->vma[i].end != 0 && np->vma[i].ip)
+      np->vma[i].ip = idup(np->vma[i].ip);
+  }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  while(--i >= 0){
+    v = &p->vma[i];
+    if(v->end != 0 && v->flags != 0)
+      uvmunmap(np->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+  }
   return -1;
 }
 
+// Release all the regions in a vma table that has
+// no pages mapped, e.g. one exec() gave up on.
+// Must be called inside a transaction, since it
+// puts the regions' inodes.
+void
+vmaclear(struct vma *vma)
+{
+  for(int i = 0; i < NVMA; i++){
+    if(vma[i].end != 0 && vma[i].ip)
+      iput(vma[i].ip);
+    vma[i].end = 0;
+    vma[i].ip = 0;
+  }
+}
+
+// Remove [start, end) from p's region v: unmap its
+// pages, and shrink, split or free v.
+// returns 0 on success, -1 if a split needs a free vma
+// and there's none.
+static int
+vmacut(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  struct vma *nv = 0;
+  uint64 d;
+
+  if(start > v->start && end < v->end){
+    for(nv = p->vma; nv < &p->vma[NVMA] && nv->end != 0; nv++)
+      ;
+    if(nv == &p->vma[NVMA])
+      return -1;
+  }
+
+  uvmunmap(p->pagetable, start, (end - start) / PGSIZE, 1);
+
+  if(nv || (start == v->start && end < v->end)){
+    // the part above [start, end) stays.
+    if(nv){
+      *nv = *v;
+      if(nv->ip)
+        nv->ip = idup(nv->ip);
+      v->end = start;
+      v = nv;
+    }
+    d = end - v->start;
+    v->start = end;
+    v->off += d;
+    v->filesz = v->filesz > d ? v->filesz - d : 0;
+  } else if(start > v->start){
+    v->end = start;
+  } else {
+    if(v->ip){
+      begin_op();
+      iput(v->ip);
+      end_op();
+    }
+    v->end = 0;
+    v->ip = 0;
+  }
+  return 0;
+}
+
+// Lowest address of p's mmap()ed regions; the heap
+// can't grow past it.
+uint64
+mmapbase(struct proc *p)
+{
+  uint64 base = TRAPFRAME;
+
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0 && v->flags != 0 && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Map len bytes of ip at off (or zeroes, if ip is 0) into
+// p, just below its lowest existing mapping. Pages are
+// filled in on first access, except those of a shared
+// anonymous region, which must exist to be shared by fork().
+// returns the address, or -1 on failure.
+uint64
+vmamap(struct proc *p, uint64 len, int perm, int flags, struct inode *ip, uint off)
+{
+  struct vma *v;
+  uint64 base = mmapbase(p), va;
+
+  len = PGROUNDUP(len);
+  if(len == 0 || base < len || base - len < PGROUNDUP(p->sz))
+    return -1;
+  uvmpin(p);
+  for(v = p->vma; v < &p->vma[NVMA] && v->end != 0; v++)
+    ;
+  if(v == &p->vma[NVMA]){
+    uvmunpin(p);
+    return -1;
+  }
+
+  v->start = base - len;
+  v->end = base;
+  v->perm = perm;
+  v->flags = flags;
+  v->ip = ip ? idup(ip) : 0;
+  v->off = off;
+  v->filesz = 0;
+  if(ip){
+    ilock(ip);
+    if(off < ip->size)
+      v->filesz = ip->size - off < len ? ip->size - off : len;
+    iunlock(ip);
+  } else if(flags & MAP_SHARED){
+    for(va = v->start; va < v->end; va += PGSIZE){
+      if(vmafill(p->pagetable, v, va) != 0){
+        vmacut(p, v, v->start, v->end);
+        uvmunpin(p);
+        return -1;
+      }
+    }
+  }
+  va = v->start;
+  uvmunpin(p);
+  return va;
+}
+
+// Unmap [addr, addr+len) from p, which must lie
+// within one mmap()ed region.
+// returns 0 on success, -1 on failure.
+int
+vmaunmap(struct proc *p, uint64 addr, uint64 len)
+{
+  uint64 end = addr + PGROUNDUP(len);
+  int r = -1;
+
+  if(addr % PGSIZE != 0 || end <= addr)
+    return -1;
+  uvmpin(p);
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end != 0 && v->flags != 0 && addr >= v->start && end <= v->end){
+      r = vmacut(p, v, addr, end);
+      break;
+    }
+  }
+  uvmunpin(p);
+  return r;
+}
+
+// Fill in the file pages of p's vmas in [va, va+n) that
+// aren't there yet, for a read() or write() that is about
+// to copy to or from them with another file's inode locked.
+// A fault in that copy would lock the vma's inode too, and
+// two processes doing so to each other's files would
+// deadlock. Pages evicted after this come back from swap,
+// which takes no inode lock. Stops at the first page it
+// can't fill in: the copy fails there anyway.
+void
+vmaprefault(struct proc *p, uint64 va, uint64 n)
+{
+  struct vma *v;
+  uint64 a, end;
+  pte_t *pte;
+
+  if(va >= MAXVA || n > MAXVA - va)
+    return;
+  uvmpin(p);
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->ip == 0)
+      continue;
+    a = PGROUNDDOWN(va) > v->start ? PGROUNDDOWN(va) : v->start;
+    end = va + n < v->end ? va + n : v->end;
+    if(end > v->start + v->filesz)
+      end = v->start + v->filesz;
+    for(; a < end; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte && (*pte & (PTE_V|PTE_SWAP)))
+        continue;
+      if(vmafill(p->pagetable, v, a) != 0)
+        break;
+    }
+  }
+  uvmunpin(p);
+}
+
+// Unmap all of p's regions, writing back shared
+// mappings, e.g. in exit() and exec().
+// Must not be called inside a transaction.
+void
+vmafree(struct proc *p)
+{
+  for(struct vma *v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end != 0)
+      vmacut(p, v, v->start, v->end);
+}
+
+// The translation of the user page a copy last went
+// through. A copy spanning several pages usually finds
+// the next page's PTE right after it in the same
+// page-table page, or finds the page inside the same
+// megapage, without walking the page table again.
+struct uvmcache {
+  uint64 va;     // page-aligned user address
+  pte_t *pte;    // its leaf PTE, or 0 if none yet
+  int level;     // pte's level: 1 for a megapage
+  struct proc *p; // pinned for the copy, if it's p's page table
+};
+
+// Physical address of the page-aligned user address va,
+// for copyin() and copyout(). Faults the page in as a
+// user access would, if pagetable is the current process's,
+// which may sleep: callers must not hold spinlocks.
+// returns 0 if there's no such page, or if a copyout()
+// would write to a read-only page.
+static uint64
+uvmaddr(pagetable_t pagetable, uint64 va, int write, struct uvmcache *c)
+{
+  struct proc *p = myproc();
+  uint64 need = PTE_V | PTE_U | (write ? PTE_W : 0);
+  pte_t *pte;
+  int level;
+
+  if(va >= MAXVA)
+    return 0;
+  if(c->p == 0 && p && p->pagetable == pagetable){
+    uvmpin(p);
+    c->p = p;
+  }
+
+  if(c->pte && va == c->va + PGSIZE && va % MEGAPGSIZE != 0){
+    level = c->level;
+    pte = level == 0 ? c->pte + 1 : c->pte;
+    if((*pte & need) == need)
+      goto found;
+  }
+
+  level = 0;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || (*pte & need) != need){
+    if(c->p){
+      if(uvmfault(p, va, write ? PTE_W : PTE_R) != 0)
+        return 0;
+    } else if(pte && write && (*pte & PTE_COW)){
+      if(uvmcow(pagetable, va) != 0)
+        return 0;
+    } else {
+      return 0;
+    }
+    // the fault may have promoted a megapage,
+    // freeing pte's page-table page.
+    level = 0;
+    pte = walklevel(pagetable, va, 0, &level);
+    if(pte == 0 || (*pte & need) != need)
+      return 0;
+  }
+
+ found:
+  c->va = va;
+  c->pte = pte;
+  c->level = level;
+  return PTE2PA(*pte) + (level == 1 ? va % MEGAPGSIZE : 0);
+}
+
+// Done with the copy that used c.
+static void
+uvmdone(struct uvmcache *c)
+{
+  if(c->p)
+    uvmunpin(c->p);
+}
+
+// Copy n bytes from src to dst, which mustn't overlap,
+// eight at a time where both are equally aligned.
+static void
+copywords(char *dst, const char *src, uint64 n)
+{
+  if(((uint64)dst - (uint64)src) % 8 == 0){
+    for(; n > 0 && (uint64)src % 8 != 0; n--)
+      *dst++ = *src++;
+    for(; n >= 8; n -= 8, dst += 8, src += 8)
+      *(uint64*)dst = *(const uint64*)src;
+  }
+  while(n-- > 0)
+    *dst++ = *src++;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -351,22 +1355,26 @@ uvmclear(pagetable_t pagetable, uint64 va)
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
+  struct uvmcache c = { 0, 0, 0, 0 };
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pa0 = uvmaddr(pagetable, va0, 1, &c);
+    if(pa0 == 0){
+      uvmdone(&c);
       return -1;
+    }
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    copywords((char *)(pa0 + (dstva - va0)), src, n);
 
     len -= n;
     src += n;
     dstva = va0 + PGSIZE;
   }
+  uvmdone(&c);
   return 0;
 }
 
@@ -376,25 +1384,32 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
+  struct uvmcache c = { 0, 0, 0, 0 };
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pa0 = uvmaddr(pagetable, va0, 0, &c);
+    if(pa0 == 0){
+      uvmdone(&c);
       return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    copywords(dst, (char *)(pa0 + (srcva - va0)), n);
 
     len -= n;
     dst += n;
     srcva = va0 + PGSIZE;
   }
+  uvmdone(&c);
   return 0;
 }
 
+// true if some byte of the word w is zero.
+#define HASZERO(w) (((w) - 0x0101010101010101L) & ~(w) & 0x8080808080808080L)
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
@@ -402,20 +1417,40 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
+  struct uvmcache c = { 0, 0, 0, 0 };
+  uint64 n, va0, pa0, w;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pa0 = uvmaddr(pagetable, va0, 0, &c);
+    if(pa0 == 0){
+      uvmdone(&c);
       return -1;
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
     char *p = (char *) (pa0 + (srcva - va0));
     while(n > 0){
+      if(n >= 8 && (uint64)p % 8 == 0){
+        // eight bytes at a time, until a word holds the '\0'.
+        w = *(uint64*)p;
+        if(!HASZERO(w)){
+          if((uint64)dst % 8 == 0){
+            *(uint64*)dst = w;
+          } else {
+            for(int i = 0; i < 8; i++)
+              dst[i] = w >> (8*i);
+          }
+          n -= 8;
+          max -= 8;
+          p += 8;
+          dst += 8;
+          continue;
+        }
+      }
       if(*p == '\0'){
         *dst = '\0';
         got_null = 1;
@@ -431,6 +1466,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
     srcva = va0 + PGSIZE;
   }
+  uvmdone(&c);
   if(got_null){
     return 0;
   } else {
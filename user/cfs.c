@@ -25,9 +25,9 @@ int main(int argc, char *argv[])
                 sleep(10);
             }
         }
-        char *stats = malloc(sizeof(char) * 4);
+        uint64 *stats = malloc(sizeof(uint64) * 4);
         get_cfs_stats(getpid(), stats);
-        printf("PID: %d, CFS priority: %d, runtime: %d, sleep time: %d,runnable time: %d\n",
+        printf("PID: %d, CFS priority: %l, runtime: %l ns, sleep time: %l ns,runnable time: %l ns\n",
                getpid(), stats[0], stats[1], stats[2], stats[3]);
         free(stats);
         exit(0, "");
@@ -49,9 +49,9 @@ int main(int argc, char *argv[])
                     sleep(10);
                 }
             }
-            char *stats = malloc(sizeof(char) * 4);
+            uint64 *stats = malloc(sizeof(uint64) * 4);
             get_cfs_stats(getpid(), stats);
-            printf("PID: %d, CFS priority: %d, runtime: %d, sleep time: %d,runnable time: %d\n",
+            printf("PID: %d, CFS priority: %l, runtime: %l ns, sleep time: %l ns,runnable time: %l ns\n",
                    getpid(), stats[0], stats[1], stats[2], stats[3]);
             free(stats);
             exit(0, "");
@@ -73,9 +73,9 @@ int main(int argc, char *argv[])
                         sleep(10);
                     }
                 }
-                char *stats = malloc(sizeof(char) * 4);
+                uint64 *stats = malloc(sizeof(uint64) * 4);
                 get_cfs_stats(getpid(), stats);
-                printf("PID: %d, CFS priority: %d, runtime: %d, sleep time: %d,runnable time: %d\n",
+                printf("PID: %d, CFS priority: %l, runtime: %l ns, sleep time: %l ns,runnable time: %l ns\n",
                        getpid(), stats[0], stats[1], stats[2], stats[3]);
                 free(stats);
                 exit(0, "");
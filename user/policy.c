@@ -0,0 +1,41 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/sched.h"
+#include "user/user.h"
+
+// policy default|priority|cfs|global [pid]
+// Switch the system's scheduling policy, or one process's.
+int
+main(int argc, char *argv[])
+{
+  char *names[] = { "default", "priority", "cfs" };
+  int pid = 0, policy;
+
+  if (argc < 2 || argc > 3)
+  {
+    fprintf(2, "usage: policy default|priority|cfs|global [pid]\n");
+    exit(1, "");
+  }
+  if (strcmp(argv[1], "global") == 0)
+    policy = SCHED_GLOBAL;
+  else
+  {
+    for (policy = 0; policy < 3; policy++)
+      if (strcmp(argv[1], names[policy]) == 0)
+        break;
+    if (policy == 3)
+    {
+      fprintf(2, "policy: unknown policy %s\n", argv[1]);
+      exit(1, "");
+    }
+  }
+  if (argc == 3)
+    pid = atoi(argv[2]);
+
+  if (sched_policy(pid, policy) < 0)
+  {
+    fprintf(2, "policy: cannot set policy\n");
+    exit(1, "");
+  }
+  exit(0, "");
+}
@@ -25,7 +25,11 @@ int uptime(void);
 int memsize(void);
 void set_ps_priority(int);
 void set_cfs_priority(int);
-void get_cfs_stats(int, char *);
+int get_cfs_stats(int, uint64 *);
+int sched_policy(int, int);
+void *mmap(void *, int, int, int, int, int);
+int munmap(void *, int);
+int nmegapages(void);
 
 // ulib.c
 int stat(const char *, struct stat *);
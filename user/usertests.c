@@ -7,6 +7,8 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/mman.h"
+#include "kernel/sched.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -1778,6 +1780,99 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// read a file sequentially, so the kernel reads ahead,
+// in parallel with writes that overwrite what's read ahead.
+void
+readahead(char *s)
+{
+  enum { NB = 64 };
+  int fd, i, j, pid, xstatus;
+  uint *w = (uint*)buf;
+
+  unlink("readahead");
+  fd = open("readahead", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: cannot create readahead\n", s);
+    exit(1,"");
+  }
+  for(i = 0; i < NB; i++){
+    for(j = 0; j < BSIZE/sizeof(uint); j++)
+      w[j] = i;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write readahead failed\n", s);
+      exit(1,"");
+    }
+  }
+  close(fd);
+
+  for(int round = 0; round < 2; round++){
+    // the second time, a child rewrites the even blocks
+    // while the parent reads.
+    pid = 0;
+    if(round == 1 && (pid = fork()) == 0){
+      fd = open("readahead", O_RDWR);
+      for(i = 0; i < NB; i++){
+        if(i % 2){
+          if(read(fd, buf, BSIZE) != BSIZE)
+            exit(1,"");
+          continue;
+        }
+        for(j = 0; j < BSIZE/sizeof(uint); j++)
+          w[j] = i + NB;
+        if(write(fd, buf, BSIZE) != BSIZE)
+          exit(1,"");
+      }
+      exit(0,"");
+    }
+    fd = open("readahead", O_RDONLY);
+    for(i = 0; i < NB*4; i++){
+      // quarter blocks at a time, as cat would.
+      if(read(fd, buf, BSIZE/4) != BSIZE/4){
+        printf("%s: short read\n", s);
+        exit(1,"");
+      }
+      for(j = 0; j < BSIZE/4/sizeof(uint); j++){
+        if(w[j] != i/4 && w[j] != i/4 + NB){
+          printf("%s: block %d holds %d\n", s, i/4, w[j]);
+          exit(1,"");
+        }
+      }
+    }
+    close(fd);
+    if(pid > 0){
+      wait(&xstatus, 0);
+      if(xstatus != 0)
+        exit(1,"");
+    }
+  }
+  unlink("readahead");
+}
+
+// move a process into a scheduling class and back to
+// following the system's policy.
+void
+schedpolicy(char *s)
+{
+  int pid = getpid();
+
+  if(sched_policy(pid, SCHED_CFS) != 0){
+    printf("%s: sched_policy(CFS) failed\n", s);
+    exit(1,"");
+  }
+  if(sched_policy(pid, SCHED_GLOBAL) != 0){
+    printf("%s: sched_policy(GLOBAL) failed\n", s);
+    exit(1,"");
+  }
+  if(sched_policy(pid, SCHED_GLOBAL-1) != -1 || sched_policy(pid, 100) != -1){
+    printf("%s: sched_policy accepted a bad policy\n", s);
+    exit(1,"");
+  }
+  if(sched_policy(0, SCHED_GLOBAL) != -1){
+    printf("%s: system policy set to GLOBAL\n", s);
+    exit(1,"");
+  }
+}
+
 void
 fourteen(char *s)
 {
@@ -2571,6 +2666,271 @@ badarg(char *s)
   exit(0,"");
 }
 
+// fork() of a process using more than half of physical
+// memory only works if the pages are shared copy-on-write.
+// a store, and a read() into a shared page (copyout),
+// must each give the child its own copy.
+void
+cowfork(char *s)
+{
+  uint64 sz = 70*1024*1024;
+  char *a, *p;
+  int fds[2], pid, xstatus;
+
+  a = sbrk(sz);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, sz);
+    exit(1,"");
+  }
+  for(p = a; p < a + sz; p += 4096)
+    *(int*)p = (int)(uint64)p;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1,"");
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1,"");
+  }
+  if(pid == 0){
+    for(p = a; p < a + sz; p += 4096*64)
+      *(int*)p = -1;
+    if(read(fds[0], a + 4096, 1) != 1)
+      exit(1,"");
+    exit(0,"");
+  }
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1,"");
+  }
+  wait(&xstatus, 0);
+  if(xstatus != 0)
+    exit(xstatus,"");
+  for(p = a; p < a + sz; p += 4096){
+    if(*(int*)p != (int)(uint64)p){
+      printf("%s: parent's page changed by child\n", s);
+      exit(1,"");
+    }
+  }
+  sbrk(-sz);
+}
+
+// mmap() a file privately and check that stores don't
+// reach the file, and that a writable shared mapping of a
+// file is refused. then check that a shared anonymous
+// mapping is shared with a fork()ed child.
+void
+mmaptest(char *s)
+{
+  int fd, i, j, n, pid, xstatus;
+  char *a, buf[64];
+  int sz = 2*4096 + 100;
+
+  unlink("mmapf");
+  fd = open("mmapf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open mmapf failed\n", s);
+    exit(1,"");
+  }
+  for(i = 0; i < sz; i += n){
+    n = sz - i < sizeof(buf) ? sz - i : sizeof(buf);
+    for(j = 0; j < n; j++)
+      buf[j] = 'a' + (i + j) % 26;
+    if(write(fd, buf, n) != n){
+      printf("%s: write mmapf failed\n", s);
+      exit(1,"");
+    }
+  }
+
+  a = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap private failed\n", s);
+    exit(1,"");
+  }
+  for(i = 0; i < sz; i++){
+    if(a[i] != 'a' + i % 26){
+      printf("%s: mmap private read wrong byte at %d\n", s, i);
+      exit(1,"");
+    }
+  }
+  if(a[sz] != 0 || a[3*4096-1] != 0){
+    printf("%s: mmap past end of file not zero\n", s);
+    exit(1,"");
+  }
+  a[0] = 'X';
+  if(munmap(a, sz) != 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1,"");
+  }
+
+  // nothing would make stores to a shared mapping of a
+  // file visible to read()s, so there's no such thing.
+  if(mmap(0, sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)0xffffffffffffffffL){
+    printf("%s: writable shared mmap of a file succeeded\n", s);
+    exit(1,"");
+  }
+  close(fd);
+
+  fd = open("mmapf", O_RDONLY);
+  a = mmap(0, sz, PROT_READ, MAP_SHARED, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap shared failed\n", s);
+    exit(1,"");
+  }
+  if(a[0] != 'a' || a[2*4096] != 'a' + (2*4096) % 26){
+    printf("%s: private store reached the file\n", s);
+    exit(1,"");
+  }
+  munmap(a, sz);
+  close(fd);
+  unlink("mmapf");
+
+  a = mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1,"");
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1,"");
+  }
+  if(pid == 0){
+    a[10] = 42;
+    exit(0,"");
+  }
+  wait(&xstatus, 0);
+  if(xstatus != 0 || a[10] != 42){
+    printf("%s: shared anonymous mapping not shared\n", s);
+    exit(1,"");
+  }
+  munmap(a, 4096);
+}
+
+// two processes each read() one file into a fresh private
+// mapping of the other, so each copy faults on a page of a
+// file the other has locked. that must not deadlock.
+void
+mmapcross(char *s)
+{
+  char *names[2] = { "mmapx0", "mmapx1" };
+  int fd, i, j, pid, xstatus, sz = 4*4096;
+  char *a, buf[512];
+
+  for(i = 0; i < 2; i++){
+    unlink(names[i]);
+    fd = open(names[i], O_CREATE|O_RDWR);
+    if(fd < 0){
+      printf("%s: open %s failed\n", s, names[i]);
+      exit(1,"");
+    }
+    memset(buf, 'a' + i, sizeof(buf));
+    for(j = 0; j < sz; j += sizeof(buf)){
+      if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf("%s: write %s failed\n", s, names[i]);
+        exit(1,"");
+      }
+    }
+    close(fd);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1,"");
+  }
+  i = pid == 0;
+  for(j = 0; j < 20; j++){
+    fd = open(names[1-i], O_RDONLY);
+    a = mmap(0, sz, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("%s: mmap failed\n", s);
+      exit(1,"");
+    }
+    fd = open(names[i], O_RDONLY);
+    if(read(fd, a, sz) != sz || a[0] != 'a' + i || a[sz-1] != 'a' + i){
+      printf("%s: read into mapping failed\n", s);
+      exit(1,"");
+    }
+    close(fd);
+    munmap(a, sz);
+  }
+  if(pid == 0)
+    exit(0,"");
+  wait(&xstatus, 0);
+  if(xstatus != 0)
+    exit(xstatus,"");
+  unlink(names[0]);
+  unlink(names[1]);
+}
+
+// touching every page of a big heap lets the kernel promote
+// aligned 2 MiB stretches to megapages; fork() demotes them,
+// and writing every page once the child is gone promotes them
+// again. shrinking the heap by a page demotes them too. the
+// contents must survive all of that.
+void
+megapages(char *s)
+{
+  uint64 sz = 6*1024*1024;
+  char *a, *p;
+  int pid, xstatus, n;
+
+  a = sbrk(sz);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1,"");
+  }
+  n = nmegapages();
+  for(p = a; p < a + sz; p += 4096)
+    *(uint64*)p = (uint64)p;
+  // 6 MiB of heap holds at least two aligned 2 MiB stretches.
+  if(nmegapages() < n + 2){
+    printf("%s: %d megapages, expected at least %d\n", s, nmegapages(), n + 2);
+    exit(1,"");
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1,"");
+  }
+  if(pid == 0){
+    for(p = a; p < a + sz; p += 4096)
+      if(*(uint64*)p != (uint64)p)
+        exit(1,"");
+    exit(0,"");
+  }
+  wait(&xstatus, 0);
+  if(xstatus != 0){
+    printf("%s: child saw wrong contents\n", s);
+    exit(1,"");
+  }
+  for(p = a; p < a + sz; p += 4096)
+    *(uint64*)p = (uint64)p;
+  if(nmegapages() < n + 2){
+    printf("%s: %d megapages after fork, expected at least %d\n", s, nmegapages(), n + 2);
+    exit(1,"");
+  }
+
+  sbrk(-4096);
+  for(p = a; p < a + sz - 4096; p += 4096){
+    if(*(uint64*)p != (uint64)p){
+      printf("%s: wrong contents after shrink\n", s);
+      exit(1,"");
+    }
+  }
+  sbrk(4096);
+  if(*(uint64*)(a + sz - 4096) != 0){
+    printf("%s: regrown page not zero\n", s);
+    exit(1,"");
+  }
+  sbrk(-sz);
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2613,6 +2973,8 @@ struct test {
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
+  {readahead, "readahead"},
+  {schedpolicy, "schedpolicy"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
@@ -2620,6 +2982,10 @@ struct test {
   {forktest, "forktest"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
+  {cowfork, "cowfork"},
+  {mmaptest, "mmaptest"},
+  {mmapcross, "mmapcross"},
+  {megapages, "megapages"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
@@ -2924,6 +3290,31 @@ outofinodes(char *s)
   }
 }
 
+// use more memory than the machine has, so that the
+// kernel has to evict some of it to swap. every page
+// must come back with what was written to it.
+void
+swapping(char *s)
+{
+  uint64 sz = 160*1024*1024;
+  char *a, *p;
+
+  a = sbrk(sz);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1,"");
+  }
+  for(p = a; p < a + sz; p += 4096)
+    *(uint64*)p = (uint64)p;
+  for(p = a; p < a + sz; p += 4096){
+    if(*(uint64*)p != (uint64)p){
+      printf("%s: wrong contents at %p\n", s, p);
+      exit(1,"");
+    }
+  }
+  sbrk(-sz);
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -2931,6 +3322,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swapping, "swapping"},
     
   { 0, 0},
 };
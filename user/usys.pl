@@ -40,3 +40,7 @@ entry("memsize");
 entry("set_ps_priority");
 entry("set_cfs_priority");
 entry("get_cfs_stats");
+entry("sched_policy");
+entry("mmap");
+entry("munmap");
+entry("nmegapages");